@@ -0,0 +1,224 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Host-side model of the flash programming time saved by never programming
+ * all-ones long words.
+ *
+ * Programming erased flash to 0xFFFFFFFF changes nothing, but a Program
+ * Longword command still takes its full execution time and a Program Section
+ * command still pays for every long word in it. This program walks an image
+ * sector by sector the way flash_state_machine() does after an erase, with and
+ * without blank word elision, and adds up the FTFL execution times.
+ *
+ * Pass .bin images on the command line, or run it without arguments for a
+ * set of synthetic images with typical padding.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "dfu.h"
+
+// FTFL command execution times, K20 72 MHz datasheet typical figures.
+// Program Section is 2.4 ms for 512 bytes and 4.7 ms for 1 kB, which is a
+// fixed part plus a part per long word.
+#define PGM4_US							65.0
+#define PGMSEC_CMD_US					96.0
+#define PGMSEC_WORD_US					18.0
+
+#define APP_SIZE						(P_FLASH_END + 1 - APP_ORIGIN)
+
+typedef struct
+{
+	double longword_us;
+	double section_us;
+	unsigned longword_cmds;
+	unsigned section_cmds;
+} bench_cost_t;
+
+static unsigned next_run(const uint32_t *words, unsigned *offset)
+{
+	// Same run splitting as flash_next_run() in dfu.c, in long words
+	unsigned first = *offset;
+	unsigned last;
+	unsigned blank = 0;
+
+	while (first < FLASH_SECTOR_SIZE / 4 && words[first] == 0xFFFFFFFF)
+	{
+		first++;
+	}
+	*offset = first;
+
+	for (last = first; last < FLASH_SECTOR_SIZE / 4 && (last - first) < FLASH_SECTION_SIZE / 4; last++)
+	{
+		if (words[last] != 0xFFFFFFFF)
+		{
+			blank = 0;
+		}
+		else if (++blank == DFU_BLANK_RUN_MIN)
+		{
+			last++;
+			break;
+		}
+	}
+
+	while (last > first && words[last - 1] == 0xFFFFFFFF)
+	{
+		last--;
+	}
+	return last - first;
+}
+
+static void cost_sector(const uint32_t *words, int elide, bench_cost_t *cost)
+{
+	if (!elide)
+	{
+		cost->longword_cmds += FLASH_SECTOR_SIZE / 4;
+		cost->longword_us += (FLASH_SECTOR_SIZE / 4) * PGM4_US;
+		cost->section_cmds += FLASH_SECTOR_SIZE / FLASH_SECTION_SIZE;
+		cost->section_us += (FLASH_SECTOR_SIZE / FLASH_SECTION_SIZE) * (PGMSEC_CMD_US + (FLASH_SECTION_SIZE / 4) * PGMSEC_WORD_US);
+		return;
+	}
+
+	for (unsigned i = 0; i < FLASH_SECTOR_SIZE / 4; i++)
+	{
+		if (words[i] != 0xFFFFFFFF)
+		{
+			cost->longword_cmds++;
+			cost->longword_us += PGM4_US;
+		}
+	}
+
+	unsigned offset = 0;
+	unsigned run;
+	while ((run = next_run(words, &offset)) != 0)
+	{
+		cost->section_cmds++;
+		cost->section_us += PGMSEC_CMD_US + run * PGMSEC_WORD_US;
+		offset += run;
+	}
+}
+
+static void bench_image(const char *name, const uint8_t *image, size_t length)
+{
+	static uint32_t sector[FLASH_SECTOR_SIZE / 4];
+	bench_cost_t plain = { 0 };
+	bench_cost_t elided = { 0 };
+	unsigned blank_words = 0;
+	unsigned total_words = 0;
+
+	for (size_t base = 0; base < length; base += FLASH_SECTOR_SIZE)
+	{
+		size_t chunk = length - base < FLASH_SECTOR_SIZE ? length - base : FLASH_SECTOR_SIZE;
+
+		// Padded with 0xFF past the end of the image, like the sector ring
+		memset(sector, 0xFF, sizeof(sector));
+		memcpy(sector, image + base, chunk);
+
+		for (unsigned i = 0; i < FLASH_SECTOR_SIZE / 4; i++)
+		{
+			blank_words += (sector[i] == 0xFFFFFFFF);
+		}
+		total_words += FLASH_SECTOR_SIZE / 4;
+
+		cost_sector(sector, 0, &plain);
+		cost_sector(sector, 1, &elided);
+	}
+
+	printf("%s: %zu bytes, %u sectors, %.1f%% all-ones long words\n", name, length,
+		total_words / (FLASH_SECTOR_SIZE / 4), 100.0 * blank_words / total_words);
+	printf("  long word  %6u cmds %9.1f ms  ->  %6u cmds %9.1f ms  (-%.1f%%)\n",
+		plain.longword_cmds, plain.longword_us / 1000.0, elided.longword_cmds, elided.longword_us / 1000.0,
+		100.0 * (1.0 - elided.longword_us / plain.longword_us));
+	printf("  section    %6u cmds %9.1f ms  ->  %6u cmds %9.1f ms  (-%.1f%%)\n\n",
+		plain.section_cmds, plain.section_us / 1000.0, elided.section_cmds, elided.section_us / 1000.0,
+		100.0 * (1.0 - elided.section_us / plain.section_us));
+}
+
+static uint32_t lcg_state = 12345;
+
+static uint32_t lcg_next()
+{
+	lcg_state = lcg_state * 1664525 + 1013904223;
+	return lcg_state;
+}
+
+static void fill_code(uint8_t *image, size_t from, size_t to)
+{
+	// Code and constant data. A few words happen to be all ones.
+	for (size_t i = from; i + 4 <= to; i += 4)
+	{
+		uint32_t word = (lcg_next() % 64) ? lcg_next() : 0xFFFFFFFF;
+		memcpy(image + i, &word, 4);
+	}
+}
+
+static void synthetic_images()
+{
+	static uint8_t image[APP_SIZE];
+	size_t length;
+
+	// Small application: vector table, code, then the linker pads the
+	// sector with the flash configuration field hole and alignment gaps.
+	memset(image, 0xFF, sizeof(image));
+	fill_code(image, 0, 0x1C0);
+	fill_code(image, 0x400, 0x410);
+	fill_code(image, 0x800, 0x9000);
+	length = 0x9000 + 0x200;
+	bench_image("small app, aligned sections", image, length);
+
+	// Application with a 32 kB 0xFF reserved area for a filesystem or
+	// EEPROM emulation between code and a lookup table.
+	memset(image, 0xFF, sizeof(image));
+	fill_code(image, 0, 0x1C0);
+	fill_code(image, 0x400, 0x410);
+	fill_code(image, 0x800, 0x14000);
+	fill_code(image, 0x1C000, 0x20000);
+	length = 0x20000;
+	bench_image("app with reserved area", image, length);
+
+	// Image padded to the full application size, as some build scripts do
+	memset(image, 0xFF, sizeof(image));
+	fill_code(image, 0, 0x1C0);
+	fill_code(image, 0x400, 0x410);
+	fill_code(image, 0x800, 0x10000);
+	length = APP_SIZE;
+	bench_image("full-size padded image", image, length);
+
+	// Worst case, no padding at all
+	for (size_t i = 0; i < APP_SIZE; i += 4)
+	{
+		uint32_t word = lcg_next() & 0x7FFFFFFF;
+		memcpy(image + i, &word, 4);
+	}
+	bench_image("dense image, no blank words", image, 0x10000);
+}
+
+int main(int argc, char **argv)
+{
+	printf("Flash programming time after erase, FTFL typical timings\n\n");
+
+	if (argc < 2)
+	{
+		synthetic_images();
+		return 0;
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		static uint8_t image[APP_SIZE];
+		FILE *file = fopen(argv[i], "rb");
+
+		if (!file)
+		{
+			perror(argv[i]);
+			return 1;
+		}
+		size_t length = fread(image, 1, sizeof(image), file);
+		fclose(file);
+		bench_image(argv[i], image, length);
+	}
+	return 0;
+}
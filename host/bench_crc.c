@@ -0,0 +1,199 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Host-side checks and benchmark for the application image CRC.
+ *
+ * src/app_image.c has the CRC module run the zlib CRC-32 over the image on
+ * the first boot after it changed. This checks the software CRC-32 the host
+ * tools and the simulator rely on: bit by bit, four bits at a time with a
+ * 16 entry table, and a byte at a time with a 256 entry table, against each
+ * other and the standard check value, then times them on the host.
+ *
+ * Nothing here runs the CRC module or measures the Cortex-M4. host/sim runs
+ * the firmware's CRC module setup against a model of the module, and on the
+ * target the boot profile's main() to decision phase includes the check,
+ * see scripts/boot_profile.py.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "dfu.h"
+#include "app_image.h"
+
+#define APP_SIZE						(P_FLASH_END + 1 - APP_ORIGIN)
+#define MAX_LENGTH						300
+
+static unsigned failures = 0;
+
+#define CHECK(cond, ...)														\
+	do																			\
+	{																			\
+		if (!(cond) && failures++ < 10)											\
+		{																		\
+			printf("  FAIL: " __VA_ARGS__);										\
+			printf("\n");														\
+		}																		\
+	} while (0)
+
+#define REFERENCE						__attribute__ ((noinline))
+
+REFERENCE static uint32_t crc32_bitwise(const uint8_t *data, size_t length)
+{
+	uint32_t crc = APP_IMAGE_CRC_SEED;
+
+	while (length--)
+	{
+		crc ^= *data++;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+		}
+	}
+	return ~crc;
+}
+
+// Four bits at a time, 64 bytes of table
+static const uint32_t crc32_nibble_table[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+REFERENCE static uint32_t crc32_nibble(const uint8_t *data, size_t length)
+{
+	uint32_t crc = APP_IMAGE_CRC_SEED;
+
+	while (length--)
+	{
+		crc ^= *data++;
+		crc = (crc >> 4) ^ crc32_nibble_table[crc & 0xF];
+		crc = (crc >> 4) ^ crc32_nibble_table[crc & 0xF];
+	}
+	return ~crc;
+}
+
+static uint32_t crc32_byte_table[256];
+
+static void make_byte_table(void)
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+		}
+		crc32_byte_table[i] = crc;
+	}
+}
+
+REFERENCE static uint32_t crc32_table(const uint8_t *data, size_t length)
+{
+	uint32_t crc = APP_IMAGE_CRC_SEED;
+
+	while (length--)
+	{
+		crc = (crc >> 8) ^ crc32_byte_table[(crc ^ *data++) & 0xFF];
+	}
+	return ~crc;
+}
+
+static void fill_random(uint8_t *buffer, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		buffer[i] = rand();
+	}
+}
+
+static unsigned check_crcs(void)
+{
+	static uint8_t buffer[APP_SIZE];
+	unsigned cases = 0;
+
+	CHECK(crc32_bitwise((const uint8_t *)"123456789", 9) == 0xCBF43926, "check value");
+	cases++;
+
+	fill_random(buffer, sizeof(buffer));
+	for (size_t length = 0; length <= MAX_LENGTH; length++)
+	{
+		uint32_t expected = crc32_bitwise(buffer + length, length);
+
+		CHECK(crc32_nibble(buffer + length, length) == expected, "nibble table, length %zu", length);
+		CHECK(crc32_table(buffer + length, length) == expected, "byte table, length %zu", length);
+		cases++;
+	}
+
+	uint32_t expected = crc32_bitwise(buffer, sizeof(buffer));
+	CHECK(crc32_nibble(buffer, sizeof(buffer)) == expected, "nibble table, whole application area");
+	CHECK(crc32_table(buffer, sizeof(buffer)) == expected, "byte table, whole application area");
+	return cases + 1;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Nanoseconds per call, best of a few rounds
+#define TIME(result, iterations, call)											\
+	do																			\
+	{																			\
+		result = 1e30;															\
+		for (int round = 0; round < 5; round++)									\
+		{																		\
+			double start = now_ns();											\
+			for (long i = 0; i < (iterations); i++)								\
+			{																	\
+				call;															\
+				__asm__ volatile ("" ::: "memory");								\
+			}																	\
+			double ns = (now_ns() - start) / (iterations);						\
+			if (ns < result)													\
+			{																	\
+				result = ns;													\
+			}																	\
+		}																		\
+	} while (0)
+
+static void print_timing(const char *name, double ns, size_t length)
+{
+	printf("  %-36s %10.1f us  %8.1f MB/s\n", name, ns / 1000.0, length / ns * 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+	srand(1);
+	make_byte_table();
+
+	printf("CRC-32 checks, lengths 0-%d and the whole application area\n", MAX_LENGTH);
+	unsigned cases = check_crcs();
+	printf("  bitwise, nibble and byte table %u cases, %u failures\n", cases, failures);
+
+	if (failures)
+	{
+		return 1;
+	}
+
+	static uint8_t image[APP_SIZE];
+	volatile uint32_t sink;
+	double elapsed;
+
+	fill_random(image, sizeof(image));
+
+	printf("\nHost timing, whole %u byte application area\n", APP_SIZE);
+	TIME(elapsed, 5, sink = crc32_bitwise(image, sizeof(image)));
+	print_timing("bitwise", elapsed, sizeof(image));
+	TIME(elapsed, 20, sink = crc32_nibble(image, sizeof(image)));
+	print_timing("nibble table, 64 bytes", elapsed, sizeof(image));
+	TIME(elapsed, 20, sink = crc32_table(image, sizeof(image)));
+	print_timing("byte table, 1K", elapsed, sizeof(image));
+	(void)sink;
+
+	return 0;
+}
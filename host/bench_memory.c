@@ -0,0 +1,262 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Host-side checks and benchmark for the memory primitives in src/memory.c.
+ *
+ * First every source and destination alignment and every length up to a few
+ * LDM/STM blocks is checked against plain byte loops, then the byte loop
+ * dfu.c used to copy each packet is timed against the word aligned versions.
+ * The host compiles the C fallback instead of the LDM/STM loops, so neither
+ * the checks nor the timings cover those.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Build the firmware's versions next to the C library's
+#define memcpy							fw_memcpy
+#define memset							fw_memset
+#define memcmp							fw_memcmp
+#include "memory.c"
+#undef memcpy
+#undef memset
+#undef memcmp
+
+#define MAX_OFFSET						8
+#define MAX_LENGTH						136
+#define GUARD							16
+#define BUFFER_SIZE						(GUARD + MAX_OFFSET + MAX_LENGTH + GUARD)
+
+#define PACKET_SIZE						64
+#define SECTOR_SIZE						2048
+
+static unsigned failures = 0;
+
+#define CHECK(cond, ...)														\
+	do																			\
+	{																			\
+		if (!(cond) && failures++ < 10)											\
+		{																		\
+			printf("  FAIL: " __VA_ARGS__);										\
+			printf("\n");														\
+		}																		\
+	} while (0)
+
+#define REFERENCE						__attribute__ ((noinline, optimize("no-tree-vectorize", "no-tree-loop-distribute-patterns")))
+
+// The byte loop dfu.c had before memory.c
+REFERENCE static void *byte_memcpy(void *dst, const void *src, size_t cnt)
+{
+	uint8_t *dst8 = dst;
+	const uint8_t *src8 = src;
+	while (cnt > 0)
+	{
+		cnt--;
+		*(dst8++) = *(src8++);
+	}
+	return dst;
+}
+
+REFERENCE static void byte_memset(void *dst, int value, size_t cnt)
+{
+	uint8_t *dst8 = dst;
+	while (cnt > 0)
+	{
+		cnt--;
+		*(dst8++) = (uint8_t)value;
+	}
+}
+
+REFERENCE static int byte_memcmp(const void *a, const void *b, size_t cnt)
+{
+	const uint8_t *a8 = a;
+	const uint8_t *b8 = b;
+	for (size_t i = 0; i < cnt; i++)
+	{
+		if (a8[i] != b8[i])
+		{
+			return a8[i] - b8[i];
+		}
+	}
+	return 0;
+}
+
+static int sign(int value)
+{
+	return (value > 0) - (value < 0);
+}
+
+static void fill_random(uint8_t *buffer, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		buffer[i] = rand();
+	}
+}
+
+static unsigned check_copies(void)
+{
+	static uint8_t src[BUFFER_SIZE], dst[BUFFER_SIZE], expected[BUFFER_SIZE];
+	unsigned cases = 0;
+
+	for (int src_offset = 0; src_offset < MAX_OFFSET; src_offset++)
+	for (int dst_offset = 0; dst_offset < MAX_OFFSET; dst_offset++)
+	for (size_t length = 0; length <= MAX_LENGTH; length++)
+	{
+		uint8_t *from = src + GUARD + src_offset;
+		uint8_t *to = dst + GUARD + dst_offset;
+
+		fill_random(src, sizeof(src));
+		fill_random(dst, sizeof(dst));
+		memcpy(expected, dst, sizeof(dst));
+		byte_memcpy(expected + GUARD + dst_offset, from, length);
+
+		void *result = fw_memcpy(to, from, length);
+		CHECK(result == to && !memcmp(dst, expected, sizeof(dst)),
+			"memcpy src+%d dst+%d length %zu", src_offset, dst_offset, length);
+		cases++;
+	}
+	return cases;
+}
+
+static unsigned check_fills(void)
+{
+	static const int values[] = { 0x00, 0xFF, 0xA5, 0x1FF };
+	static uint8_t dst[BUFFER_SIZE], expected[BUFFER_SIZE];
+	unsigned cases = 0;
+
+	for (int v = 0; v < sizeof(values) / sizeof(values[0]); v++)
+	for (int dst_offset = 0; dst_offset < MAX_OFFSET; dst_offset++)
+	for (size_t length = 0; length <= MAX_LENGTH; length++)
+	{
+		uint8_t *to = dst + GUARD + dst_offset;
+
+		fill_random(dst, sizeof(dst));
+		memcpy(expected, dst, sizeof(dst));
+		byte_memset(expected + GUARD + dst_offset, values[v], length);
+
+		void *result = fw_memset(to, values[v], length);
+		CHECK(result == to && !memcmp(dst, expected, sizeof(dst)),
+			"memset 0x%X dst+%d length %zu", values[v], dst_offset, length);
+		cases++;
+	}
+	return cases;
+}
+
+static unsigned check_compares(void)
+{
+	static uint8_t a[BUFFER_SIZE], b[BUFFER_SIZE];
+	unsigned cases = 0;
+
+	for (int a_offset = 0; a_offset < MAX_OFFSET; a_offset++)
+	for (int b_offset = 0; b_offset < MAX_OFFSET; b_offset++)
+	for (size_t length = 0; length <= MAX_LENGTH; length++)
+	{
+		uint8_t *left = a + GUARD + a_offset;
+		uint8_t *right = b + GUARD + b_offset;
+
+		fill_random(a, sizeof(a));
+		fill_random(b, sizeof(b));
+		memcpy(right, left, length);
+
+		CHECK(fw_memcmp(left, right, length) == 0,
+			"memcmp equal a+%d b+%d length %zu", a_offset, b_offset, length);
+		cases++;
+
+		// A difference at every position, in both directions
+		for (size_t position = 0; position < length; position++)
+		{
+			uint8_t saved = right[position];
+			right[position] = left[position] ^ (1 << (position % 8));
+
+			CHECK(sign(fw_memcmp(left, right, length)) == sign(byte_memcmp(left, right, length)),
+				"memcmp a+%d b+%d length %zu byte %zu", a_offset, b_offset, length, position);
+			CHECK(sign(fw_memcmp(right, left, length)) == sign(byte_memcmp(right, left, length)),
+				"memcmp b+%d a+%d length %zu byte %zu", b_offset, a_offset, length, position);
+
+			right[position] = saved;
+			cases++;
+		}
+	}
+	return cases;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Nanoseconds per call, best of a few rounds
+#define TIME(result, iterations, call)											\
+	do																			\
+	{																			\
+		result = 1e30;															\
+		for (int round = 0; round < 5; round++)									\
+		{																		\
+			double start = now_ns();											\
+			for (long i = 0; i < (iterations); i++)								\
+			{																	\
+				call;															\
+				__asm__ volatile ("" ::: "memory");								\
+			}																	\
+			double ns = (now_ns() - start) / (iterations);						\
+			if (ns < result)													\
+			{																	\
+				result = ns;													\
+			}																	\
+		}																		\
+	} while (0)
+
+static void print_timing(const char *name, double before, double after)
+{
+	printf("  %-36s %8.1f ns  %8.1f ns  %5.1fx\n", name, before, after, before / after);
+}
+
+int main(int argc, char **argv)
+{
+	srand(1);
+
+	printf("Alignment checks, offsets 0-%d and lengths 0-%d\n", MAX_OFFSET - 1, MAX_LENGTH);
+	unsigned copies = check_copies();
+	unsigned fills = check_fills();
+	unsigned compares = check_compares();
+	printf("  memcpy %u, memset %u, memcmp %u cases, %u failures\n",
+		copies, fills, compares, failures);
+
+	if (failures)
+	{
+		return 1;
+	}
+
+	static uint8_t src[SECTOR_SIZE] __attribute__ ((aligned(4)));
+	static uint8_t dst[SECTOR_SIZE + 4] __attribute__ ((aligned(4)));
+	static uint8_t same[SECTOR_SIZE] __attribute__ ((aligned(4)));
+	volatile int sink;
+	double before, after;
+
+	fill_random(src, sizeof(src));
+	memcpy(same, src, sizeof(src));
+
+	printf("\nHost timing                             byte loop    memory.c  speedup\n");
+	TIME(before, 2000000, byte_memcpy(dst, src, PACKET_SIZE));
+	TIME(after, 2000000, fw_memcpy(dst, src, PACKET_SIZE));
+	print_timing("64 byte packet copy", before, after);
+	TIME(before, 2000000, byte_memcpy(dst + 1, src, PACKET_SIZE));
+	TIME(after, 2000000, fw_memcpy(dst + 1, src, PACKET_SIZE));
+	print_timing("64 byte packet copy, misaligned", before, after);
+	TIME(before, 100000, byte_memset(dst, 0xFF, SECTOR_SIZE));
+	TIME(after, 100000, fw_memset(dst, 0xFF, SECTOR_SIZE));
+	print_timing("sector slot erase fill", before, after);
+	TIME(before, 100000, sink = byte_memcmp(same, src, SECTOR_SIZE));
+	TIME(after, 100000, sink = fw_memcmp(same, src, SECTOR_SIZE));
+	print_timing("sector verify compare", before, after);
+	(void)sink;
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Host-side model of a DFU download at different wTransferSize settings.
+ *
+ * Every DFU block costs the host one DFU_DNLOAD control transfer and at least
+ * one DFU_GETSTATUS control transfer, plus the bwPollTimeout the host sleeps
+ * between them. Each control transfer in turn costs a SETUP and STATUS stage
+ * and, on a typical full-speed host stack, about one frame of scheduling and
+ * completion latency no matter how little data it carries. This program adds
+ * those costs up for an image so the effect of the block size can be compared
+ * without a board on the bench.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "dfu.h"
+#include "usb_desc.h"
+
+// Full speed bus, 12 Mbit/s. Token, CRC, handshake and inter-packet gaps
+// come to roughly 20 bytes worth of bit times per transaction.
+#define BUS_BYTES_PER_US				1.5
+#define TRANSACTION_OVERHEAD_BYTES		20
+
+// Host controller + libusb completion latency per control transfer, and the
+// poll timeout the bootloader hands back in DFU_GETSTATUS.
+#define HOST_TRANSFER_LATENCY_US		1000.0
+#define POLL_TIMEOUT_US					1000.0
+
+static double transaction_us(unsigned bytes)
+{
+	return (TRANSACTION_OVERHEAD_BYTES + bytes) / BUS_BYTES_PER_US;
+}
+
+static double control_transfer_us(unsigned data_bytes)
+{
+	// SETUP, data stage packets, STATUS
+	double us = transaction_us(8) + transaction_us(0);
+	
+	while (data_bytes > 0)
+	{
+		unsigned packet = data_bytes > EP0_SIZE ? EP0_SIZE : data_bytes;
+		us += transaction_us(packet);
+		data_bytes -= packet;
+	}
+	
+	return us + HOST_TRANSFER_LATENCY_US;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned image_size = (argc > 1) ? strtoul(argv[1], NULL, 0) : 200 * 1024;
+	double baseline_us = 0;
+	
+	printf("DFU download of a %u byte image, modelled host timing\n\n", image_size);
+	printf("wTransferSize  blocks  round trips  time [ms]  speedup\n");
+	
+	for (unsigned transfer_size = EP0_SIZE; transfer_size <= FLASH_SECTOR_SIZE; transfer_size *= 2)
+	{
+		unsigned blocks = (image_size + transfer_size - 1) / transfer_size;
+		double block_us = control_transfer_us(transfer_size) + control_transfer_us(6) + POLL_TIMEOUT_US;
+		
+		// Final zero length DFU_DNLOAD and its status poll
+		double total_us = blocks * block_us + control_transfer_us(0) + control_transfer_us(6);
+		unsigned round_trips = 2 * blocks + 2;
+		
+		if (transfer_size == EP0_SIZE)
+		{
+			baseline_us = total_us;
+		}
+		
+		printf("%13u  %6u  %11u  %9.1f  %6.1fx%s\n", transfer_size, blocks, round_trips,
+			total_us / 1000.0, baseline_us / total_us,
+			transfer_size == DFU_TRANSFER_SIZE ? "  <- DFU_TRANSFER_SIZE" : "");
+	}
+	
+	return 0;
+}
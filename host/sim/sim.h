@@ -0,0 +1,32 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Host simulator, included ahead of every firmware source file it builds.
+ *
+ * The firmware keeps using kinetis.h as it is. Its registers are mapped at
+ * their real addresses by sim_main.c, and only the few things that can't be
+ * plain memory on a PC are redirected here: the interrupt mask, WFI and the
+ * CPU's view of program flash.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#pragma once
+#include <stdint.h>
+#include "kinetis.h"
+
+void sim_disable_irq(void);
+void sim_enable_irq(void);
+void sim_wfi(void);
+const void *sim_flash_ptr(uint32_t address);
+
+#undef __disable_irq
+#undef __enable_irq
+#undef __WFI
+
+// Masking interrupts for good only happens when the bootloader reboots or
+// launches the application, right before a simulated run ends.
+#define __disable_irq()						sim_disable_irq()
+#define __enable_irq()						sim_enable_irq()
+#define __WFI()								sim_wfi()
+
+#define FLASH_PTR(address)					sim_flash_ptr(address)
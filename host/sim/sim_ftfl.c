@@ -0,0 +1,407 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Host simulator, FTFL flash memory module.
+ *
+ * Commands are decoded from FCCOB when CCIF is written, run for their typical
+ * execution time, then set CCIF again along with MGSTAT0 where the command
+ * found something. ACCERR is raised at launch for anything the real module
+ * would refuse. Programming is an AND into the array, like the real cells, so
+ * writing a long word twice shows up. Those and other things the hardware
+ * wouldn't forgive are counted as violations and fail the run.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#include <string.h>
+#include "sim_model.h"
+
+// Command execution times in microseconds, approximately the typical figures
+// from the K20 72 MHz data sheet. Override them to model another part.
+#ifndef SIM_ERASE_SECTOR_US
+#define SIM_ERASE_SECTOR_US					14000.0
+#endif
+#ifndef SIM_ERASE_BLOCK_US
+#define SIM_ERASE_BLOCK_US					122000.0
+#endif
+#ifndef SIM_PGM4_US
+#define SIM_PGM4_US							65.0
+#endif
+#ifndef SIM_PGMSEC_CMD_US
+#define SIM_PGMSEC_CMD_US					96.0
+#endif
+#ifndef SIM_PGMSEC_WORD_US
+#define SIM_PGMSEC_WORD_US					18.0
+#endif
+#ifndef SIM_RD1SEC_CMD_US
+#define SIM_RD1SEC_CMD_US					15.0
+#endif
+#ifndef SIM_RD1SEC_WORD_US
+#define SIM_RD1SEC_WORD_US					0.18
+#endif
+#ifndef SIM_PGMCHK_US
+#define SIM_PGMCHK_US						45.0
+#endif
+#ifndef SIM_SETRAM_US
+#define SIM_SETRAM_US						70.0
+#endif
+
+// Time spent by one read of FSTAT while polling it, about 5 CPU cycles
+#define SIM_POLL_US							0.05
+
+#define FLEXRAM_ADDRESS						0x14000000
+
+// Program flash is one block on the MK20DX256, so there is no read-while-write
+// within it. Erase Flash Block takes all of it, bootloader and all.
+#define SIM_P_FLASH_BLOCK_SIZE				SIM_FLASH_SIZE
+
+static struct
+{
+	bool busy;
+	double started_at;
+	double done_at;
+	uint8_t command;
+	uint32_t address;
+	uint32_t longwords;
+	uint8_t expected[4];
+	uint8_t flexram[FLEXRAM_SIZE / 2];
+} ftfl;
+
+static uint32_t fccob_address(void)
+{
+	return (SIM_REG(FTFL_FCCOB1) << 16) | (SIM_REG(FTFL_FCCOB2) << 8) | SIM_REG(FTFL_FCCOB3);
+}
+
+static bool is_fccob(uint32_t address)
+{
+	return address >= SIM_ADDR(FTFL_FCCOB3) && address <= SIM_ADDR(FTFL_FCCOB8);
+}
+
+static bool in_block(uint32_t a, uint32_t b)
+{
+	return (a / SIM_P_FLASH_BLOCK_SIZE) == (b / SIM_P_FLASH_BLOCK_SIZE);
+}
+
+static void guard_bootloader(uint32_t address)
+{
+	// Nothing protects the bootloader sectors in FPROT, only the firmware's own checks
+	if (address < APP_ORIGIN)
+	{
+		sim_violation("FTFL command 0x%02x modifies the bootloader at 0x%05x", ftfl.command, address);
+	}
+}
+
+static void program_word(uint32_t address, const uint8_t *bytes)
+{
+	uint8_t *cell = sim_flash + address;
+	bool was_blank = true;
+	bool reached = true;
+
+	for (int i = 0; i < 4; i++)
+	{
+		was_blank &= (cell[i] == 0xFF);
+	}
+	if (!was_blank)
+	{
+		// Kinetis flash must not be programmed twice without an erase
+		sim_violation("long word 0x%05x programmed twice without an erase", address);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		cell[i] &= bytes[i];
+		reached &= (cell[i] == bytes[i]);
+	}
+	if (!reached)
+	{
+		// Program verify failed, bits can only go from 1 to 0
+		SIM_REG(FTFL_FSTAT) |= FTFL_FSTAT_MGSTAT0;
+	}
+}
+
+static void access_error(const char *why)
+{
+	SIM_REG(FTFL_FSTAT) |= FTFL_FSTAT_ACCERR | FTFL_FSTAT_CCIF;
+	sim_stats->cmd_errors++;
+	sim_violation("FTFL command 0x%02x at 0x%05x: ACCERR, %s", ftfl.command, ftfl.address, why);
+}
+
+static void launch(void)
+{
+	double duration = 0;
+
+	ftfl.command = SIM_REG(FTFL_FCCOB0);
+	ftfl.address = fccob_address();
+	SIM_REG(FTFL_FSTAT) &= ~(FTFL_FSTAT_CCIF | FTFL_FSTAT_MGSTAT0);
+
+	switch (ftfl.command)
+	{
+		case FTFL_CMD_READ_1S_SECTION:
+			ftfl.longwords = (SIM_REG(FTFL_FCCOB4) << 8) | SIM_REG(FTFL_FCCOB5);
+			if ((ftfl.address & 3) || !ftfl.longwords || ftfl.address + ftfl.longwords * 4 > SIM_FLASH_SIZE)
+			{
+				access_error("bad read 1s range");
+				return;
+			}
+			if (SIM_REG(FTFL_FCCOB6) > FTFL_MARGIN_FACTORY)
+			{
+				access_error("bad margin");
+				return;
+			}
+			sim_stats->cmd_read_1s_section++;
+			duration = SIM_RD1SEC_CMD_US + ftfl.longwords * SIM_RD1SEC_WORD_US;
+			break;
+
+		case FTFL_CMD_PROGRAM_CHECK:
+			if ((ftfl.address & 3) || ftfl.address >= SIM_FLASH_SIZE)
+			{
+				access_error("bad program check address");
+				return;
+			}
+			if (SIM_REG(FTFL_FCCOB4) != FTFL_MARGIN_USER && SIM_REG(FTFL_FCCOB4) != FTFL_MARGIN_FACTORY)
+			{
+				access_error("program check needs user or factory margin");
+				return;
+			}
+			// FCCOB8 is the byte at the highest address
+			ftfl.expected[3] = SIM_REG(FTFL_FCCOB8);
+			ftfl.expected[2] = SIM_REG(FTFL_FCCOB9);
+			ftfl.expected[1] = SIM_REG(FTFL_FCCOBA);
+			ftfl.expected[0] = SIM_REG(FTFL_FCCOBB);
+			sim_stats->cmd_program_check++;
+			duration = SIM_PGMCHK_US;
+			break;
+
+		case FTFL_CMD_PROGRAM_LONG_WORD:
+			if ((ftfl.address & 3) || ftfl.address >= SIM_FLASH_SIZE)
+			{
+				access_error("bad long word address");
+				return;
+			}
+			guard_bootloader(ftfl.address);
+			// FCCOB4 is the byte at the highest address
+			ftfl.expected[3] = SIM_REG(FTFL_FCCOB4);
+			ftfl.expected[2] = SIM_REG(FTFL_FCCOB5);
+			ftfl.expected[1] = SIM_REG(FTFL_FCCOB6);
+			ftfl.expected[0] = SIM_REG(FTFL_FCCOB7);
+			sim_stats->cmd_program_long_word++;
+			duration = SIM_PGM4_US;
+			break;
+
+		case FTFL_CMD_ERASE_FLASH_BLOCK:
+			if (ftfl.address >= SIM_FLASH_SIZE)
+			{
+				access_error("bad block address");
+				return;
+			}
+			ftfl.address &= ~(SIM_P_FLASH_BLOCK_SIZE - 1);
+			guard_bootloader(ftfl.address);
+			sim_stats->cmd_erase_block++;
+			duration = SIM_ERASE_BLOCK_US;
+			break;
+
+		case FTFL_CMD_ERASE_FLASH_SECTOR:
+			if ((ftfl.address & 3) || ftfl.address >= SIM_FLASH_SIZE)
+			{
+				access_error("bad sector address");
+				return;
+			}
+			ftfl.address &= ~(FLASH_SECTOR_SIZE - 1);
+			guard_bootloader(ftfl.address);
+			sim_stats->cmd_erase_sector++;
+			duration = SIM_ERASE_SECTOR_US;
+			break;
+
+		case FTFL_CMD_PROGRAM_SECTOR:
+			ftfl.longwords = (SIM_REG(FTFL_FCCOB4) << 8) | SIM_REG(FTFL_FCCOB5);
+			if (!(SIM_REG(FTFL_FCNFG) & FTFL_FCNFG_RAMRDY))
+			{
+				access_error("FlexRAM is not available as RAM");
+				return;
+			}
+			if ((ftfl.address & 3) || !ftfl.longwords || ftfl.longwords * 4 > sizeof(ftfl.flexram)
+				|| ftfl.address + ftfl.longwords * 4 > SIM_FLASH_SIZE || !in_block(ftfl.address, ftfl.address + ftfl.longwords * 4 - 1))
+			{
+				access_error("bad section range");
+				return;
+			}
+			guard_bootloader(ftfl.address);
+			// The module reads FlexRAM while it programs, remember what it saw
+			memcpy(ftfl.flexram, (const void *)(uintptr_t)FLEXRAM_ADDRESS, ftfl.longwords * 4);
+			sim_stats->cmd_program_section++;
+			duration = SIM_PGMSEC_CMD_US + ftfl.longwords * SIM_PGMSEC_WORD_US;
+			break;
+
+		case FTFL_CMD_SET_FLEXRAM:
+			if (SIM_REG(FTFL_FCCOB1) != FTFL_CMD_SET_FLEXRAM_RAM)
+			{
+				// No FlexNVM partition, so no EEPROM either
+				access_error("no EEPROM partition");
+				return;
+			}
+			sim_stats->cmd_set_flexram++;
+			duration = SIM_SETRAM_US;
+			break;
+
+		default:
+			access_error("command not modelled");
+			return;
+	}
+
+	ftfl.busy = true;
+	ftfl.started_at = sim_now;
+	ftfl.done_at = sim_now + duration;
+}
+
+static void complete(void)
+{
+	volatile uint8_t *fstat = &SIM_REG(FTFL_FSTAT);
+	uint32_t i;
+
+	switch (ftfl.command)
+	{
+		case FTFL_CMD_READ_1S_SECTION:
+			for (i = 0; i < ftfl.longwords * 4; i++)
+			{
+				if (sim_flash[ftfl.address + i] != 0xFF)
+				{
+					*fstat |= FTFL_FSTAT_MGSTAT0;
+					break;
+				}
+			}
+			break;
+
+		case FTFL_CMD_PROGRAM_CHECK:
+			if (memcmp(sim_flash + ftfl.address, ftfl.expected, 4))
+			{
+				*fstat |= FTFL_FSTAT_MGSTAT0;
+			}
+			break;
+
+		case FTFL_CMD_PROGRAM_LONG_WORD:
+			program_word(ftfl.address, ftfl.expected);
+			break;
+
+		case FTFL_CMD_ERASE_FLASH_BLOCK:
+			memset(sim_flash + ftfl.address, 0xFF, SIM_P_FLASH_BLOCK_SIZE);
+			break;
+
+		case FTFL_CMD_ERASE_FLASH_SECTOR:
+			memset(sim_flash + ftfl.address, 0xFF, FLASH_SECTOR_SIZE);
+			break;
+
+		case FTFL_CMD_PROGRAM_SECTOR:
+			if (memcmp(ftfl.flexram, (const void *)(uintptr_t)FLEXRAM_ADDRESS, ftfl.longwords * 4))
+			{
+				sim_violation("FlexRAM modified during a program section command at 0x%05x", ftfl.address);
+			}
+			for (i = 0; i < ftfl.longwords; i++)
+			{
+				program_word(ftfl.address + i * 4, ftfl.flexram + i * 4);
+			}
+			break;
+
+		case FTFL_CMD_SET_FLEXRAM:
+			SIM_REG(FTFL_FCNFG) |= FTFL_FCNFG_RAMRDY;
+			break;
+	}
+
+	if (*fstat & FTFL_FSTAT_MGSTAT0)
+	{
+		sim_stats->cmd_errors++;
+	}
+	*fstat |= FTFL_FSTAT_CCIF;
+	ftfl.busy = false;
+	sim_stats->ftfl_busy_us += ftfl.done_at - ftfl.started_at;
+}
+
+void sim_ftfl_reset(void)
+{
+	memset(&ftfl, 0, sizeof(ftfl));
+	SIM_REG(FTFL_FSTAT) = FTFL_FSTAT_CCIF;
+	SIM_REG(FTFL_FCNFG) = 0;
+	SIM_REG(FTFL_FPROT0) = 0xFF;
+	SIM_REG(FTFL_FPROT1) = 0xFF;
+	SIM_REG(FTFL_FPROT2) = 0xFF;
+	SIM_REG(FTFL_FPROT3) = 0xFF;
+}
+
+void sim_ftfl_update(void)
+{
+	if (ftfl.busy && sim_now >= ftfl.done_at)
+	{
+		complete();
+	}
+}
+
+double sim_ftfl_next_event(void)
+{
+	return ftfl.busy ? ftfl.done_at : __builtin_inf();
+}
+
+bool sim_ftfl_irq(void)
+{
+	return (SIM_REG(FTFL_FCNFG) & FTFL_FCNFG_CCIE) && (SIM_REG(FTFL_FSTAT) & FTFL_FSTAT_CCIF);
+}
+
+void sim_ftfl_read(uint32_t address)
+{
+	// Polling FSTAT is what lets time pass in a busy wait
+	if (address == SIM_ADDR(FTFL_FSTAT) && ftfl.busy)
+	{
+		sim_now += SIM_POLL_US;
+		sim_ftfl_update();
+	}
+}
+
+void sim_ftfl_write(uint32_t address, uint32_t old)
+{
+	uint8_t before = (uint8_t)old;
+	uint8_t *reg = sim_alias(address);
+	uint8_t written = *reg;
+
+	if (address == SIM_ADDR(FTFL_FSTAT))
+	{
+		// Error flags are write 1 to clear, writing CCIF launches the command
+		*reg = before & ~(written & (FTFL_FSTAT_RDCOLERR | FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL));
+		if ((written & FTFL_FSTAT_CCIF) && (before & FTFL_FSTAT_CCIF))
+		{
+			if (*reg & (FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL))
+			{
+				sim_violation("FTFL command launched with ACCERR or FPVIOL still set");
+			}
+			else
+			{
+				launch();
+			}
+		}
+	}
+	else if (address == SIM_ADDR(FTFL_FCNFG))
+	{
+		// RAMRDY, EEERDY and friends are read only
+		uint8_t writable = FTFL_FCNFG_CCIE | FTFL_FCNFG_RDCOLLIE | FTFL_FCNFG_ERSSUSP;
+		*reg = (written & writable) | (before & ~writable);
+	}
+	else if (is_fccob(address) && ftfl.busy)
+	{
+		// Ignored by the module while a command runs
+		*reg = before;
+		sim_violation("FCCOB written while an FTFL command is running");
+	}
+	else if (address == SIM_ADDR(FTFL_FSEC) || address == SIM_ADDR(FTFL_FOPT))
+	{
+		*reg = before;
+	}
+}
+
+const void *sim_flash_ptr(uint32_t address)
+{
+	// Reading a block while the FTFL works on it is a read collision. With a
+	// single program flash block that is any flash read.
+	if (ftfl.busy && (ftfl.command == FTFL_CMD_SET_FLEXRAM || in_block(address, ftfl.address)))
+	{
+		SIM_REG(FTFL_FSTAT) |= FTFL_FSTAT_RDCOLERR;
+		sim_stats->read_collisions++;
+		sim_violation("flash read at 0x%05x collides with FTFL command 0x%02x", address, ftfl.command);
+	}
+	return sim_flash + address;
+}
@@ -0,0 +1,1162 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Host simulator. Runs the real bootloader sources on a PC against modelled
+ * FTFL, USB and NVIC hardware, downloads images into it the way dfu-util
+ * does, and reports how long that takes in simulated time.
+ *
+ * The peripheral address space is mapped at the addresses kinetis.h uses, so
+ * the firmware builds unchanged. Registers with side effects sit on pages the
+ * firmware can't write (or, for the FTFL, can't touch at all). An access
+ * faults, the page is opened up for that single instruction, and the
+ * single-step trap afterwards hands the access to the peripheral model, which
+ * then applies write 1 to clear flags, launches commands and so on. SysTick
+ * counts core clock cycles of simulated time, like the DWT cycle counter.
+ *
+ * Every run is a fresh process, like a reboot: RAM starts over, flash is
+ * shared and survives from the previous run. A run ends when the firmware
+ * reboots through the watchdog or starts the application. Downloads reset
+ * into DFU mode with the boot token, the boot runs after the built-in
+ * downloads reset without it, into sealed images and one without a trailer.
+ * Every run starts with boot_fast_path(), as ResetHandler does, then main().
+ *
+ *   sim                              built-in set of synthetic downloads
+ *   sim [--alt N] [--stream] [--upload] image.bin ...
+ *                                    images in order, starting from blank flash,
+ *                                    --stream sends them over the vendor stream
+ *                                    interface instead of DFU_DNLOAD, --upload
+ *                                    reads the application area back with
+ *                                    DFU_UPLOAD after each one
+ *
+ * x86-64 Linux only, see the sim target in Makefile.linux for the build.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "sim_model.h"
+#include "core_pins.h"
+#include "boot_profile.h"
+#include "boot_handoff.h"
+#include "app_image.h"
+
+#define SIM_PAGE_SIZE						0x1000
+#define SIM_ISR_US							1.0				// Entry, exit and a little work per interrupt
+#define SIM_TIME_LIMIT_US					60e6
+#define SIM_MAX_RUNS						20
+#define SIM_SYSTICK_READ_US					0.05			// A read of SYST_CVR, so busy waits on it see time pass
+#define SIM_DWT_READ_US						0.05			// Same for ARM_DWT_CYCCNT
+#define SIM_CRC_WORD_US						(8.5 / (F_CPU / 1e6))	// Flash load and wait states, store to CRC_CRC, loop
+#define APP_SIZE							(P_FLASH_END + 1 - APP_ORIGIN)
+
+double sim_now;
+uint8_t *sim_flash;
+sim_stats_t *sim_stats;
+
+// Peripheral bridge and GPIO, then the Cortex-M4 private peripheral bus
+static struct
+{
+	uint32_t base;
+	uint32_t size;
+	uint8_t *alias;
+} regions[] =
+{
+	{ 0x40000000, 0x100000, NULL },
+	{ 0xE0000000, 0x100000, NULL },
+};
+
+static void crc_read(uint32_t address);
+static void crc_write(uint32_t address, uint32_t old);
+static void wdog_write(uint32_t address, uint32_t old);
+static void mcg_write(uint32_t address, uint32_t old);
+static void scs_read(uint32_t address);
+static void scs_write(uint32_t address, uint32_t old);
+static void dwt_read(uint32_t address);
+
+static const struct
+{
+	uint32_t page;
+	int prot;								// While the firmware isn't accessing it
+	void (*read)(uint32_t address);
+	void (*write)(uint32_t address, uint32_t old);
+} traps[] =
+{
+	{ 0x40020000, PROT_NONE, sim_ftfl_read, sim_ftfl_write },
+	{ 0x40032000, PROT_NONE, crc_read, crc_write },
+	{ 0x40052000, PROT_READ, NULL, wdog_write },
+	{ 0x40064000, PROT_READ, NULL, mcg_write },
+	{ 0x40072000, PROT_READ, NULL, sim_usb_write },
+	{ 0xE0001000, PROT_NONE, dwt_read, NULL },
+	{ 0xE000E000, PROT_NONE, scs_read, scs_write },
+};
+
+static struct
+{
+	int trap;								// -1 when no access is in flight
+	uint32_t address;
+	bool write;
+	uint32_t old;
+} trap_access = { -1 };
+
+// SysTick, reloaded from SYST_RVR every SYST_RVR + 1 cycles
+static struct
+{
+	double loaded_at;						// When the count last started from SYST_RVR
+	bool pending;
+} systick;
+
+static bool systick_irq(void);
+
+// CRC module, the CRC register as it is before the read transposition
+static uint32_t crc_register;
+
+// Set by __disable_irq(), nothing gets to interrupt after that
+static bool irq_masked;
+
+// Interrupts wired to the firmware, in vector order. SysTick is a system
+// exception, not an NVIC interrupt, and has its own pending bit.
+#define SIM_SYSTICK							(-1)
+
+static const struct
+{
+	int irq;
+	void (*isr)(void);
+	bool (*level)(void);
+} sim_irqs[] =
+{
+	{ SIM_SYSTICK, systick_isr, systick_irq },
+	{ IRQ_FTFL_COMPLETE, flash_cmd_isr, sim_ftfl_irq },
+	{ IRQ_USBOTG, usb_isr, sim_usb_irq },
+};
+
+static uint32_t nvic_enabled[(NVIC_NUM_INTERRUPTS + 31) / 32];
+static uint32_t nvic_pending[(NVIC_NUM_INTERRUPTS + 31) / 32];
+
+
+void *sim_alias(uint32_t address)
+{
+	for (unsigned i = 0; i < sizeof(regions) / sizeof(regions[0]); i++)
+	{
+		if (address - regions[i].base < regions[i].size)
+		{
+			return regions[i].alias + (address - regions[i].base);
+		}
+	}
+	sim_fail("no register at 0x%08x", address);
+}
+
+void sim_fail(const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(sim_stats->message, sizeof(sim_stats->message), format, args);
+	va_end(args);
+	sim_stats->failed = true;
+	sim_stats->download_end_us = sim_now;
+	_exit(1);
+}
+
+void sim_finish(void)
+{
+	if (!sim_stats->download_end_us)
+	{
+		sim_stats->download_end_us = sim_now;
+	}
+	sim_stats->finish_us = sim_now;
+	sim_stats->finished = true;
+	_exit(0);
+}
+
+void sim_violation(const char *format, ...)
+{
+	va_list args;
+
+	if (!sim_stats->violations++)
+	{
+		va_start(args, format);
+		vsnprintf(sim_stats->message, sizeof(sim_stats->message), format, args);
+		va_end(args);
+	}
+}
+
+static void nvic_mirror(void)
+{
+	for (unsigned n = 0; n < sizeof(nvic_enabled) / sizeof(nvic_enabled[0]); n++)
+	{
+		*(uint32_t *)sim_alias(0xE000E100 + n * 4) = nvic_enabled[n];
+		*(uint32_t *)sim_alias(0xE000E180 + n * 4) = nvic_enabled[n];
+		*(uint32_t *)sim_alias(0xE000E200 + n * 4) = nvic_pending[n];
+		*(uint32_t *)sim_alias(0xE000E280 + n * 4) = nvic_pending[n];
+	}
+}
+
+static void mcg_reset(void)
+{
+	// Running from the PLL, PEE mode
+	SIM_REG(MCG_C1) = MCG_C1_CLKS(0);
+	SIM_REG(MCG_S) = MCG_S_CLKST(3) | MCG_S_LOCK0 | MCG_S_PLLST;
+}
+
+static void mcg_write(uint32_t address, uint32_t old)
+{
+	// The clock source switches right away, CLKS 0 is the PLL
+	unsigned clks = (SIM_REG(MCG_C1) >> 6) & 3;
+
+	SIM_REG(MCG_S) = (SIM_REG(MCG_S) & ~MCG_S_CLKST_MASK) | MCG_S_CLKST(clks ? clks : 3);
+	(void)address;
+	(void)old;
+}
+
+static uint32_t crc_transpose(uint32_t value, unsigned type)
+{
+	// CRC_CTRL[TOT] and [TOTR]: 1 bits in bytes, 2 bits and bytes, 3 bytes
+	if (type == 1 || type == 2)
+	{
+		value = ((value >> 1) & 0x55555555) | ((value & 0x55555555) << 1);
+		value = ((value >> 2) & 0x33333333) | ((value & 0x33333333) << 2);
+		value = ((value >> 4) & 0x0F0F0F0F) | ((value & 0x0F0F0F0F) << 4);
+	}
+	if (type == 2 || type == 3)
+	{
+		value = __builtin_bswap32(value);
+	}
+	return value;
+}
+
+static void crc_read(uint32_t address)
+{
+	uint32_t ctrl = SIM_REG(CRC_CTRL);
+
+	if ((address & ~3) == SIM_ADDR(CRC_CRC))
+	{
+		SIM_REG(CRC_CRC) = crc_transpose(crc_register, (ctrl >> 28) & 3) ^ ((ctrl & CRC_CTRL_FXOR) ? 0xFFFFFFFF : 0);
+	}
+}
+
+static void crc_write(uint32_t address, uint32_t old)
+{
+	// Long word writes only, the firmware never feeds it bytes. The data is
+	// transposed, then shifted in MSB first.
+	uint32_t ctrl = SIM_REG(CRC_CTRL);
+	uint32_t data = crc_transpose(SIM_REG(CRC_CRC), ctrl >> 30);
+
+	if (!(SIM_REG(SIM_SCGC6) & SIM_SCGC6_CRC))
+	{
+		sim_violation("CRC module written with its clock gated off");
+	}
+	if (address != SIM_ADDR(CRC_CRC))
+	{
+		return;
+	}
+	if (!(ctrl & CRC_CTRL_TCRC))
+	{
+		sim_violation("16 bit CRC, the model only does 32");
+	}
+	if (ctrl & CRC_CTRL_WAS)
+	{
+		crc_register = data;
+		return;
+	}
+
+	crc_register ^= data;
+	for (int bit = 0; bit < 32; bit++)
+	{
+		crc_register = (crc_register & 0x80000000) ? (crc_register << 1) ^ SIM_REG(CRC_GPOLY) : crc_register << 1;
+	}
+	sim_stats->crc_words++;
+	sim_now += SIM_CRC_WORD_US;
+	(void)old;
+}
+
+static void wdog_write(uint32_t address, uint32_t old)
+{
+	// Anything but the unlock and refresh sequences resets the chip, which
+	// is how the bootloader reboots
+	sim_finish();
+	(void)address;
+	(void)old;
+}
+
+static double systick_period_us(void)
+{
+	return (SIM_REG(SYST_RVR) + 1) / (F_CPU / 1e6);
+}
+
+static bool systick_running(void)
+{
+	return (SIM_REG(SYST_CSR) & SYST_CSR_ENABLE) != 0;
+}
+
+static void systick_update(void)
+{
+	if (!systick_running())
+	{
+		return;
+	}
+	double period = systick_period_us();
+	if (sim_now >= systick.loaded_at + period)
+	{
+		systick.loaded_at += period * (unsigned long)((sim_now - systick.loaded_at) / period);
+		if (SIM_REG(SYST_CSR) & SYST_CSR_TICKINT)
+		{
+			systick.pending = true;
+		}
+	}
+}
+
+static double systick_next_event(void)
+{
+	if (!systick_running() || !(SIM_REG(SYST_CSR) & SYST_CSR_TICKINT))
+	{
+		return __builtin_inf();
+	}
+	return systick.loaded_at + systick_period_us();
+}
+
+static bool systick_irq(void)
+{
+	return systick.pending;
+}
+
+static void scs_read(uint32_t address)
+{
+	// The SysTick count and pending bit as of now, the rest is plain memory
+	if (address == SIM_ADDR(SYST_CVR))
+	{
+		sim_now += SIM_SYSTICK_READ_US;
+	}
+	systick_update();
+	if (systick_running())
+	{
+		uint32_t cycles = (uint32_t)((sim_now - systick.loaded_at) * (F_CPU / 1e6));
+		SIM_REG(SYST_CVR) = SIM_REG(SYST_RVR) - cycles;
+	}
+	if (systick.pending)
+	{
+		SIM_REG(SCB_ICSR) |= SCB_ICSR_PENDSTSET;
+	}
+	else
+	{
+		SIM_REG(SCB_ICSR) &= ~SCB_ICSR_PENDSTSET;
+	}
+}
+
+static void scs_write(uint32_t address, uint32_t old)
+{
+	// NVIC set and clear registers, SysTick and its pending bit, everything
+	// else on the page is plain memory
+	uint32_t offset = address - 0xE000E000;
+	uint32_t written = *(uint32_t *)sim_alias(address & ~3);
+	unsigned n = (offset & 0x1F) / 4;
+
+	switch (address & ~3)
+	{
+		case SIM_ADDR(SYST_CSR):
+			if ((written & SYST_CSR_ENABLE) && !(old & SYST_CSR_ENABLE))
+			{
+				systick.loaded_at = sim_now;
+			}
+			return;
+
+		case SIM_ADDR(SYST_CVR):
+			// Any write clears the count, it starts over from SYST_RVR
+			systick.loaded_at = sim_now;
+			return;
+
+		case SIM_ADDR(SCB_ICSR):
+			if (written & SCB_ICSR_PENDSTCLR)
+			{
+				systick.pending = false;
+			}
+			if (written & SCB_ICSR_PENDSTSET)
+			{
+				systick.pending = true;
+			}
+			SIM_REG(SCB_ICSR) &= ~(SCB_ICSR_PENDSTCLR | SCB_ICSR_PENDSTSET);
+			return;
+	}
+
+	if (n >= sizeof(nvic_enabled) / sizeof(nvic_enabled[0]))
+	{
+		return;
+	}
+	switch (offset & ~0x1F)
+	{
+		case 0x100: nvic_enabled[n] |= written; break;
+		case 0x180: nvic_enabled[n] &= ~written; break;
+		case 0x200: nvic_pending[n] |= written; break;
+		case 0x280: nvic_pending[n] &= ~written; break;
+		default: return;
+	}
+	nvic_mirror();
+}
+
+static bool irq_ready(int irq)
+{
+	if (irq == SIM_SYSTICK)
+	{
+		return systick.pending;
+	}
+	return (nvic_enabled[irq / 32] & nvic_pending[irq / 32] & (1u << (irq % 32))) != 0;
+}
+
+static uint8_t irq_priority(int irq)
+{
+	if (irq == SIM_SYSTICK)
+	{
+		return SIM_REG(SCB_SHPR3) >> 24;
+	}
+	return ((const uint8_t *)sim_alias(0xE000E400))[irq];
+}
+
+static void irq_clear_pending(int irq)
+{
+	if (irq == SIM_SYSTICK)
+	{
+		systick.pending = false;
+		return;
+	}
+	nvic_pending[irq / 32] &= ~(1u << (irq % 32));
+	nvic_mirror();
+}
+
+static void dwt_read(uint32_t address)
+{
+	// The cycle counter follows simulated time, code itself takes none
+	sim_now += SIM_DWT_READ_US;
+	*(uint32_t *)sim_alias(0xE0001004) = (uint32_t)(uint64_t)(sim_now * (F_CPU / 1e6));
+	(void)address;
+}
+
+static int find_trap(uintptr_t address)
+{
+	for (unsigned i = 0; i < sizeof(traps) / sizeof(traps[0]); i++)
+	{
+		if (address - traps[i].page < SIM_PAGE_SIZE)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void sim_segv(int signal, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+	int trap = find_trap((uintptr_t)info->si_addr);
+
+	if (trap < 0 || trap_access.trap >= 0)
+	{
+		// A real crash, let it happen
+		fprintf(stderr, "sim: fault at %p, rip %p\n", info->si_addr, (void *)uc->uc_mcontext.gregs[REG_RIP]);
+		sigaction(SIGSEGV, &(struct sigaction){ .sa_handler = SIG_DFL }, NULL);
+		return;
+	}
+
+	trap_access.trap = trap;
+	trap_access.address = (uint32_t)(uintptr_t)info->si_addr;
+	trap_access.write = (uc->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+	if (trap_access.write)
+	{
+		memcpy(&trap_access.old, sim_alias(trap_access.address), sizeof(trap_access.old));
+	}
+	else if (traps[trap].read)
+	{
+		traps[trap].read(trap_access.address);
+	}
+
+	// Let this one instruction through, then trap again right after it
+	mprotect((void *)(uintptr_t)traps[trap].page, SIM_PAGE_SIZE, PROT_READ | PROT_WRITE);
+	uc->uc_mcontext.gregs[REG_EFL] |= 0x100;
+	(void)signal;
+}
+
+static void sim_step(int signal, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+	int trap = trap_access.trap;
+
+	uc->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+	if (trap < 0)
+	{
+		return;
+	}
+	trap_access.trap = -1;
+
+	mprotect((void *)(uintptr_t)traps[trap].page, SIM_PAGE_SIZE, traps[trap].prot);
+	if (trap_access.write && traps[trap].write)
+	{
+		traps[trap].write(trap_access.address, trap_access.old);
+	}
+	(void)signal;
+	(void)info;
+}
+
+static void map_peripherals(void)
+{
+	for (unsigned i = 0; i < sizeof(regions) / sizeof(regions[0]); i++)
+	{
+		int fd = memfd_create("sim-peripherals", 0);
+
+		if (fd < 0 || ftruncate(fd, regions[i].size) < 0)
+		{
+			sim_fail("memfd_create failed");
+		}
+		if (mmap((void *)(uintptr_t)regions[i].base, regions[i].size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0) != (void *)(uintptr_t)regions[i].base)
+		{
+			sim_fail("can't map peripherals at 0x%08x", regions[i].base);
+		}
+		regions[i].alias = mmap(NULL, regions[i].size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (regions[i].alias == MAP_FAILED)
+		{
+			sim_fail("can't map the peripheral alias");
+		}
+		close(fd);
+	}
+
+	struct sigaction action = { .sa_flags = SA_SIGINFO | SA_NODEFER };
+	action.sa_sigaction = sim_segv;
+	sigaction(SIGSEGV, &action, NULL);
+	action.sa_sigaction = sim_step;
+	sigaction(SIGTRAP, &action, NULL);
+
+	for (unsigned i = 0; i < sizeof(traps) / sizeof(traps[0]); i++)
+	{
+		mprotect((void *)(uintptr_t)traps[i].page, SIM_PAGE_SIZE, traps[i].prot);
+	}
+}
+
+static void update_peripherals(void)
+{
+	systick_update();
+	sim_ftfl_update();
+	sim_usb_update();
+}
+
+static bool dispatch_interrupts(void)
+{
+	bool ran = false;
+
+	for (unsigned storm = 0; ; storm++)
+	{
+		int best = -1;
+
+		update_peripherals();
+		for (int i = 0; i < (int)(sizeof(sim_irqs) / sizeof(sim_irqs[0])); i++)
+		{
+			int irq = sim_irqs[i].irq;
+
+			// Level sensitive, pending for as long as the peripheral asserts it
+			if (irq != SIM_SYSTICK && sim_irqs[i].level())
+			{
+				nvic_pending[irq / 32] |= 1u << (irq % 32);
+			}
+			if (irq_ready(irq) && (best < 0 || irq_priority(irq) < irq_priority(sim_irqs[best].irq)))
+			{
+				best = i;
+			}
+		}
+		if (best < 0)
+		{
+			return ran;
+		}
+		if (storm > 1000000)
+		{
+			sim_fail("interrupt %d never stops firing", sim_irqs[best].irq);
+		}
+
+		irq_clear_pending(sim_irqs[best].irq);
+		// The bus carries on while the core stacks registers and gets to
+		// the handler, what the handler finds includes that
+		sim_now += SIM_ISR_US;
+		update_peripherals();
+		sim_irqs[best].isr();
+		ran = true;
+	}
+}
+
+static void deep_sleep(void)
+{
+	// VLPS: the clocks stop, only the USB resume detector wakes the chip
+	double start = sim_now;
+
+	if ((SIM_REG(SMC_PMCTRL) & SMC_PMCTRL_STOPM(7)) != SMC_PMCTRL_STOPM(2) || !(SIM_REG(SMC_PMPROT) & SMC_PMPROT_AVLP))
+	{
+		sim_violation("deep sleep in a stop mode other than VLPS");
+	}
+	if (sim_ftfl_next_event() != __builtin_inf())
+	{
+		sim_violation("VLPS with a flash command running");
+	}
+
+	while (!sim_usb_resume_detected())
+	{
+		double next = sim_usb_next_event();
+
+		if (next == __builtin_inf() || next > SIM_TIME_LIMIT_US)
+		{
+			sim_fail("VLPS with nothing left to wake up the CPU");
+		}
+		if (next > sim_now)
+		{
+			sim_now = next;
+		}
+		sim_usb_update();
+	}
+	sim_stats->vlps_us += sim_now - start;
+
+	// SysTick stood still. The MCG comes back in PBE, on the crystal, with
+	// the PLL locked again by the time the firmware looks.
+	systick.loaded_at += sim_now - start;
+	SIM_REG(MCG_C1) = (SIM_REG(MCG_C1) & ~MCG_C1_CLKS(3)) | MCG_C1_CLKS(2);
+	SIM_REG(MCG_S) = (SIM_REG(MCG_S) & ~MCG_S_CLKST_MASK) | MCG_S_CLKST(2);
+}
+
+void sim_wfi(void)
+{
+	if (irq_masked)
+	{
+		sim_fail("WFI with interrupts masked for good");
+	}
+	if (SIM_REG(SCB_SCR) & SCB_SCR_SLEEPDEEP)
+	{
+		deep_sleep();
+	}
+
+	// Sleep until an interrupt has run, skipping ahead to the next event
+	while (!dispatch_interrupts())
+	{
+		double next = sim_ftfl_next_event();
+		double usb_next = sim_usb_next_event();
+		double systick_next = systick_next_event();
+
+		if (usb_next < next)
+		{
+			next = usb_next;
+		}
+		if (systick_next < next)
+		{
+			next = systick_next;
+		}
+		if (next == __builtin_inf())
+		{
+			sim_fail("WFI with nothing left to wake up the CPU");
+		}
+		if (next > SIM_TIME_LIMIT_US)
+		{
+			sim_fail("no end of download after %.0f s", SIM_TIME_LIMIT_US / 1e6);
+		}
+		if (next > sim_now)
+		{
+			sim_now = next;
+		}
+	}
+}
+
+void sim_disable_irq(void)
+{
+	// The bootloader is done and reboots, or starts the application
+	irq_masked = true;
+}
+
+void sim_enable_irq(void)
+{
+}
+
+// Board support the firmware links against
+uint32_t boot_token;
+boot_profile_t boot_profile;
+boot_handoff_t boot_handoff;
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+uint8_t digitalRead(uint8_t pin)
+{
+	return 1;
+}
+
+static uint32_t crc32_zlib(const uint8_t *data, size_t length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+
+	while (length--)
+	{
+		crc ^= *data++;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+		}
+	}
+	return ~crc;
+}
+
+static bool in_main;
+
+void launch_application(uint32_t stack_pointer, uint32_t entry_point)
+{
+	// The CRC module model did the handoff block, its long words aren't
+	// part of the image check
+	if (boot_handoff.magic != BOOT_HANDOFF_MAGIC ||
+		boot_handoff.crc != crc32_zlib((const uint8_t *)&boot_handoff, offsetof(boot_handoff_t, crc)))
+	{
+		sim_fail("handoff block CRC %08X", boot_handoff.crc);
+	}
+	sim_stats->crc_words -= offsetof(boot_handoff_t, crc) / 4;
+
+	sim_stats->launched = true;
+	sim_stats->fast_path = !in_main;
+	sim_finish();
+}
+
+static void run_firmware(const sim_download_t *download)
+{
+	map_peripherals();
+	mcg_reset();
+	sim_ftfl_reset();
+	sim_usb_reset(download);
+
+	// The application asks for DFU mode, or a plain reset
+	boot_token = download->boot ? 0 : 0xDEADBEEF;
+
+	// The boot pin has its pull-up and nothing pulls it low
+	SIM_REG(GPIOB_PDIR) = 0xFFFFFFFF;
+
+	// What ResetHandler does before main(). Bringing up the clocks and
+	// copying to RAM take no simulated time, the clocks are up from the start.
+	memset(&boot_profile, 0, sizeof(boot_profile));
+	boot_profile.magic = BOOT_PROFILE_MAGIC;
+	boot_profile.version = BOOT_PROFILE_VERSION;
+	boot_profile.size = sizeof(boot_profile);
+	boot_profile.f_cpu = F_CPU;
+
+	if (boot_fast_path())
+	{
+		boot_launch();
+	}
+
+	in_main = true;
+	bootloader_main();
+	sim_fail("bootloader returned from main()");
+}
+
+
+typedef struct
+{
+	const char *name;
+	const uint8_t *image;
+	size_t length;
+	uint8_t alternate;
+	bool stream;
+	bool upload;
+	unsigned suspend_ms;
+	bool boot;								// Reset without the boot token
+	bool launch;							// Expected to start the application, no download
+	bool cached;							// And to take the image as checked on an earlier boot, or
+											// for an upload, verified is programmed in flash
+	bool unsealed;							// Or to start it without a trailer, on the vector check
+	size_t stale_from;						// Before a boot the image goes into flash as if
+	size_t stale_to;						// downloaded, except this range keeps what was there
+	unsigned refused_block;					// DFU_DNLOAD refused once, then retried
+} sim_run_t;
+
+static uint8_t bootloader_image[APP_ORIGIN];
+
+static size_t trailer_offset(const uint8_t *image)
+{
+	uint32_t length;
+
+	memcpy(&length, image + APP_IMAGE_VECTOR_LENGTH * 4, 4);
+	return length;
+}
+
+static bool check_flash(const sim_run_t *run, char *why, size_t why_size)
+{
+	// Starting a sealed application programs verified in its trailer, with the sequence number
+	bool sealed_launch = !run->unsealed && (run->launch || (run->upload && run->cached));
+	size_t verified = sealed_launch ? trailer_offset(run->image) + offsetof(app_image_trailer_t, verified) : SIZE_MAX;
+
+	if (memcmp(sim_flash, bootloader_image, APP_ORIGIN))
+	{
+		snprintf(why, why_size, "bootloader modified");
+		return false;
+	}
+	if (sealed_launch && memcmp(sim_flash + APP_ORIGIN + verified,
+		run->image + verified - offsetof(app_image_trailer_t, verified) + offsetof(app_image_trailer_t, sequence), 4))
+	{
+		snprintf(why, why_size, "check not cached in the trailer");
+		return false;
+	}
+	for (size_t i = 0; i < run->length; i++)
+	{
+		if (sealed_launch && i - verified < 4)
+		{
+			continue;
+		}
+		if (sim_flash[APP_ORIGIN + i] != run->image[i])
+		{
+			snprintf(why, why_size, "mismatch at 0x%05zx", APP_ORIGIN + i);
+			return false;
+		}
+	}
+	if (run->alternate == DFU_ALT_FULL_REPLACE)
+	{
+		for (size_t i = APP_ORIGIN + run->length; i < SIM_FLASH_SIZE; i++)
+		{
+			if (sim_flash[i] != 0xFF)
+			{
+				snprintf(why, why_size, "not erased past the image at 0x%05zx", i);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool simulate(int index, const sim_run_t *run)
+{
+	sim_download_t download = { run->image, run->length, run->alternate, run->stream, run->upload, run->suspend_ms, run->boot,
+		run->refused_block };
+	char why[64] = "ok";
+	int status = 0;
+	pid_t child;
+
+	if (run->stale_to)
+	{
+		// A download that didn't make it all the way
+		memcpy(sim_flash + APP_ORIGIN, run->image, run->stale_from);
+		memcpy(sim_flash + APP_ORIGIN + run->stale_to, run->image + run->stale_to, run->length - run->stale_to);
+	}
+
+	memset(sim_stats, 0, sizeof(*sim_stats));
+	fflush(stdout);
+	child = fork();
+	if (child == 0)
+	{
+		run_firmware(&download);
+	}
+	waitpid(child, &status, 0);
+
+	printf("[%d] %s, alt %u%s, %zu bytes\n", index, run->name, run->alternate,
+		run->boot ? ", boot" : run->stream ? ", stream" : run->upload ? ", upload" : "", run->length);
+	if (!sim_stats->finished && !sim_stats->failed)
+	{
+		printf("    simulator crashed, %s %d\n", WIFSIGNALED(status) ? "signal" : "status",
+			WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+		return false;
+	}
+
+	double download_ms = (sim_stats->download_end_us - sim_stats->download_start_us) / 1000.0;
+	bool flash_ok = check_flash(run, why, sizeof(why));
+	bool boot_ok = sim_stats->launched == run->launch &&
+		(!run->launch || (sim_stats->crc_words == 0) == (run->cached || run->unsealed));
+
+	if (sim_stats->launched)
+	{
+		printf("    launch     %9.3f ms after reset, %s, from %s\n", sim_stats->finish_us / 1000.0,
+			sim_stats->crc_words ? "image checked" : run->unsealed ? "no trailer" : "checked on an earlier boot",
+			sim_stats->fast_path ? "ResetHandler" : "main()");
+	}
+	if (run->boot)
+	{
+		printf("    CRC        %9.3f ms   %u long words through the CRC module\n",
+			sim_stats->crc_words * SIM_CRC_WORD_US / 1000.0, sim_stats->crc_words);
+	}
+	if (sim_stats->launched)
+	{
+		// No download
+	}
+	else if (run->upload)
+	{
+		printf("    upload     %9.3f ms %7.1f kB/s   %u UPLOAD, %u bytes, %u NAKed, %u transactions counted\n",
+			download_ms, download_ms > 0 ? sim_stats->upload_bytes / download_ms : 0.0,
+			sim_stats->upload_requests, sim_stats->upload_bytes, sim_stats->control_naks,
+			sim_stats->upload_transactions);
+	}
+	else if (run->stream)
+	{
+		printf("    download   %9.3f ms %7.1f kB/s   %u bulk OUT, %u NAKed, %u reports\n",
+			download_ms, download_ms > 0 ? run->length / download_ms : 0.0,
+			sim_stats->stream_packets, sim_stats->stream_naks, sim_stats->stream_reports);
+	}
+	else
+	{
+		printf("    download   %9.3f ms %7.1f kB/s   %u DNLOAD, %u GETSTATUS, %u busy, %u NAKed\n",
+			download_ms, download_ms > 0 ? run->length / download_ms : 0.0,
+			sim_stats->dnload_requests, sim_stats->getstatus_requests, sim_stats->busy_polls,
+			sim_stats->control_naks);
+	}
+	if (run->suspend_ms)
+	{
+		printf("    suspend    %9.3f ms   %.3f ms of it in VLPS\n",
+			sim_stats->suspend_us / 1000.0, sim_stats->vlps_us / 1000.0);
+	}
+	if (!run->upload && !sim_stats->launched)
+	{
+		printf("    reboot     %9.3f ms later\n", (sim_stats->finish_us - sim_stats->download_end_us) / 1000.0);
+	}
+	printf("    FTFL busy  %9.3f ms   erase %u+%u blk, section %u, long word %u, read 1s %u, check %u\n",
+		sim_stats->ftfl_busy_us / 1000.0, sim_stats->cmd_erase_sector, sim_stats->cmd_erase_block,
+		sim_stats->cmd_program_section, sim_stats->cmd_program_long_word,
+		sim_stats->cmd_read_1s_section, sim_stats->cmd_program_check);
+	if (sim_stats->cmd_errors || sim_stats->discarded_packets || sim_stats->read_collisions)
+	{
+		printf("    events     %u FTFL errors, %u IN packets dropped for their toggle, %u read collisions\n",
+			sim_stats->cmd_errors, sim_stats->discarded_packets, sim_stats->read_collisions);
+	}
+	printf("    flash      %s\n", why);
+	if (sim_stats->failed || sim_stats->violations)
+	{
+		printf("    FAILED     %s%s (%u violations)\n", sim_stats->failed ? "" : "first violation: ",
+			sim_stats->message, sim_stats->violations);
+	}
+	else if (!boot_ok)
+	{
+		printf("    FAILED     expected %s\n", !run->launch ? "DFU mode" :
+			run->cached || run->unsealed ? "the application, without a CRC" : "the application, after a CRC");
+	}
+	printf("\n");
+
+	return flash_ok && boot_ok && !sim_stats->failed && !sim_stats->violations;
+}
+
+static uint32_t lcg_state = 12345;
+
+static uint32_t lcg_next(void)
+{
+	lcg_state = lcg_state * 1664525 + 1013904223;
+	return lcg_state;
+}
+
+static void fill_code(uint8_t *image, size_t from, size_t to)
+{
+	// Code and constant data, same mix as host/bench_blank_elision.c
+	for (size_t i = from; i + 4 <= to; i += 4)
+	{
+		uint32_t word = (lcg_next() % 64) ? lcg_next() : 0xFFFFFFFF;
+		memcpy(image + i, &word, 4);
+	}
+}
+
+static void fill_app(uint8_t *image, size_t length)
+{
+	// Vector table, the flash configuration hole, then code
+	memset(image, 0xFF, length);
+	fill_code(image, 0, 0x1C0);
+	fill_code(image, 0x400, 0x410);
+	fill_code(image, 0x800, length);
+}
+
+static size_t seal_app(uint8_t *image, size_t length, uint32_t sequence)
+{
+	// What scripts/app_image_seal.py does to a binary, plus a reset vector
+	// test_app_missing() takes
+	uint32_t vectors[APP_IMAGE_VECTOR_SEQUENCE + 1];
+	app_image_trailer_t trailer = { APP_IMAGE_MAGIC, sequence, length, 0, APP_IMAGE_UNVERIFIED };
+
+	memcpy(vectors, image, sizeof(vectors));
+	vectors[0] = 0x20008000;
+	vectors[1] = APP_ORIGIN + 0x801;
+	vectors[APP_IMAGE_VECTOR_LENGTH] = length;
+	vectors[APP_IMAGE_VECTOR_SEQUENCE] = sequence;
+	memcpy(image, vectors, sizeof(vectors));
+
+	trailer.crc = crc32_zlib(image, length);
+	memcpy(image + length, &trailer, sizeof(trailer));
+	return length + sizeof(trailer);
+}
+
+static void plain_app(uint8_t *image)
+{
+	// A build that was never sealed. The reserved vector table entries point
+	// at the fault handler, like the ones around them.
+	uint32_t vectors[16];
+
+	memcpy(vectors, image, sizeof(vectors));
+	vectors[0] = 0x20008000;
+	vectors[1] = APP_ORIGIN + 0x801;
+	for (int i = 2; i < 16; i++)
+	{
+		vectors[i] = APP_ORIGIN + 0x841;
+	}
+	memcpy(image, vectors, sizeof(vectors));
+}
+
+static int synthetic_runs(sim_run_t *runs)
+{
+	static uint8_t small[0x9200];
+	static uint8_t patched[sizeof(small)];
+	static uint8_t large[0x28000];
+	static uint8_t sealed[0x1F000 + sizeof(app_image_trailer_t)];
+	static uint8_t update[0x23000 + sizeof(app_image_trailer_t)];
+	static uint8_t fixed[sizeof(update)];
+	static uint8_t plain[0x18000];
+	size_t sealed_length, update_length;
+	int count = 0;
+
+	fill_app(small, sizeof(small));
+	memcpy(patched, small, sizeof(small));
+	fill_code(patched, 0x4100, 0x4180);
+	fill_app(large, sizeof(large));
+	fill_app(sealed, sizeof(sealed));
+	sealed_length = seal_app(sealed, sizeof(sealed) - sizeof(app_image_trailer_t), 1);
+	fill_app(update, sizeof(update));
+	update_length = seal_app(update, sizeof(update) - sizeof(app_image_trailer_t), 2);
+	memcpy(fixed, update, sizeof(update));
+	fill_code(fixed, 0x10100, 0x10180);
+	seal_app(fixed, sizeof(fixed) - sizeof(app_image_trailer_t), 3);
+	fill_app(plain, sizeof(plain));
+	plain_app(plain);
+
+	runs[count++] = (sim_run_t){ "small app onto blank flash", small, sizeof(small), DFU_ALT_DIFFERENTIAL };
+	runs[count++] = (sim_run_t){ "same small app again", small, sizeof(small), DFU_ALT_DIFFERENTIAL };
+	runs[count++] = (sim_run_t){ "small app, one function changed", patched, sizeof(patched), DFU_ALT_DIFFERENTIAL };
+	runs[count++] = (sim_run_t){ "large app over the small one", large, sizeof(large), DFU_ALT_DIFFERENTIAL };
+	runs[count++] = (sim_run_t){ "small app, full replace", small, sizeof(small), DFU_ALT_FULL_REPLACE };
+	// Halfway through a sector when blocks are smaller than one. A retry that
+	// started the download over would erase what went in before it.
+	runs[count++] = (sim_run_t){ "large app, full replace, a block refused and sent again", large, sizeof(large),
+		DFU_ALT_FULL_REPLACE, .refused_block = 10 * DFU_BLOCKS_PER_SECTOR + DFU_BLOCKS_PER_SECTOR / 2 };
+#if DFU_STREAM
+	runs[count++] = (sim_run_t){ "same small app again", small, sizeof(small), DFU_ALT_DIFFERENTIAL, true };
+	runs[count++] = (sim_run_t){ "large app over the small one", large, sizeof(large), DFU_ALT_DIFFERENTIAL, true };
+#endif
+
+	// Reads back whatever the run before it left in flash, as --upload does,
+	// on the same alternate setting. A full replace only erases on a download.
+	runs[count] = runs[count - 1];
+	runs[count].name = "read back the application area";
+	runs[count].stream = false;
+	runs[count++].upload = true;
+	runs[count++] = (sim_run_t){ "same large app after a 500 ms suspend", large, sizeof(large), DFU_ALT_DIFFERENTIAL, false, false, 500 };
+
+#if APP_IMAGE_CHECK
+	// Sealed images, see app_image.h, and the boots in between
+	runs[count++] = (sim_run_t){ "sealed app", sealed, sealed_length, DFU_ALT_DIFFERENTIAL };
+	runs[count++] = (sim_run_t){ "first boot of the sealed app", sealed, sealed_length, DFU_ALT_DIFFERENTIAL,
+		.boot = true, .launch = true };
+	runs[count++] = (sim_run_t){ "second boot, the check is cached", sealed, sealed_length, DFU_ALT_DIFFERENTIAL,
+		.boot = true, .launch = true, .cached = true };
+	// Comes back as it was downloaded, without verified
+	runs[count++] = (sim_run_t){ "read back the checked sealed app", sealed, sealed_length, DFU_ALT_DIFFERENTIAL,
+		.upload = true, .cached = true };
+	// Its vector table says sealed, so it doesn't boot without the trailer
+	runs[count++] = (sim_run_t){ "update stopped short of its trailer", update, update_length, DFU_ALT_DIFFERENTIAL,
+		.boot = true, .stale_from = 0x10000, .stale_to = update_length };
+	runs[count++] = (sim_run_t){ "update with a sector that didn't take", fixed, update_length, DFU_ALT_DIFFERENTIAL,
+		.boot = true, .stale_from = 0x10000, .stale_to = 0x10800 };
+	runs[count++] = (sim_run_t){ "first boot of that update", fixed, update_length, DFU_ALT_DIFFERENTIAL,
+		.boot = true, .launch = true };
+#endif
+
+	// A build without a trailer boots on the vector check alone
+	runs[count++] = (sim_run_t){ "unsealed app", plain, sizeof(plain), DFU_ALT_DIFFERENTIAL };
+	runs[count++] = (sim_run_t){ "boot of the unsealed app", plain, sizeof(plain), DFU_ALT_DIFFERENTIAL,
+		.boot = true, .launch = true, .unsealed = true };
+	return count;
+}
+
+static uint8_t *load_image(const char *path, size_t *length)
+{
+	uint8_t *image = malloc(APP_SIZE);
+	FILE *file = fopen(path, "rb");
+
+	if (!image || !file)
+	{
+		perror(path);
+		exit(2);
+	}
+	*length = fread(image, 1, APP_SIZE, file);
+	if (!feof(file) || !*length)
+	{
+		fprintf(stderr, "%s: empty or larger than the %u byte application area\n", path, APP_SIZE);
+		exit(2);
+	}
+	fclose(file);
+	return image;
+}
+
+int main(int argc, char **argv)
+{
+	sim_run_t runs[SIM_MAX_RUNS] = { { 0 } };
+	int count = 0;
+	int alternate = DFU_ALT_DIFFERENTIAL;
+	bool stream = false;
+	bool upload = false;
+	int failed = 0;
+
+	sim_flash = mmap(NULL, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	sim_stats = mmap(NULL, sizeof(*sim_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sim_flash == MAP_FAILED || sim_stats == MAP_FAILED)
+	{
+		perror("mmap");
+		return 2;
+	}
+
+	// Some bootloader, followed by an erased application area
+	for (size_t i = 0; i < APP_ORIGIN; i += 4)
+	{
+		uint32_t word = lcg_next();
+		memcpy(bootloader_image + i, &word, 4);
+	}
+	memcpy(sim_flash, bootloader_image, APP_ORIGIN);
+	memset(sim_flash + APP_ORIGIN, 0xFF, APP_SIZE);
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--alt") && i + 1 < argc)
+		{
+			alternate = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--stream"))
+		{
+			stream = true;
+		}
+		else if (!strcmp(argv[i], "--upload"))
+		{
+			upload = true;
+		}
+		else if (count + upload < SIM_MAX_RUNS)
+		{
+			runs[count].name = argv[i];
+			runs[count].image = load_image(argv[i], &runs[count].length);
+			runs[count].alternate = alternate;
+			runs[count].stream = stream;
+			runs[count].upload = false;
+			count++;
+			if (upload)
+			{
+				runs[count] = runs[count - 1];
+				runs[count].stream = false;
+				runs[count].upload = true;
+				count++;
+			}
+		}
+	}
+	if (!count)
+	{
+		count = synthetic_runs(runs);
+	}
+
+	printf("DFU download, simulated time with FTFL typical timings\n\n");
+	for (int i = 0; i < count; i++)
+	{
+		failed += !simulate(i + 1, &runs[i]);
+	}
+	if (failed)
+	{
+		printf("%d of %d downloads FAILED\n", failed, count);
+	}
+	return failed ? 1 : 0;
+}
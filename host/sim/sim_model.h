@@ -0,0 +1,108 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Host simulator, interfaces between the peripheral models.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sim.h"
+#include "dfu.h"
+
+// The firmware address of a register, and the simulator's own view of it.
+// Firmware addresses may be write protected or not mapped at all while
+// the simulator is using them, the alias never is.
+#define SIM_ADDR(reg)						((uint32_t)(uintptr_t)&(reg))
+#define SIM_REG(reg)						(*(__typeof__(&(reg)))sim_alias(SIM_ADDR(reg)))
+
+#define SIM_FLASH_SIZE						(P_FLASH_END + 1)
+
+// Simulated time, in microseconds since power up
+extern double sim_now;
+
+// Program flash as the FTFL sees it. Shared between runs, like real flash
+// survives a reboot.
+extern uint8_t *sim_flash;
+
+void *sim_alias(uint32_t address);
+void sim_fail(const char *format, ...) __attribute__ ((format(printf, 1, 2), noreturn));
+void sim_finish(void) __attribute__ ((noreturn));
+
+// Firmware entry points
+int bootloader_main(void);
+bool boot_fast_path(void);
+void boot_launch(void);
+void usb_isr(void);
+void flash_cmd_isr(void);
+
+// Statistics for one run
+typedef struct
+{
+	double download_start_us;				// First DFU_DNLOAD, STREAM_BEGIN or DFU_UPLOAD
+	double download_end_us;					// Host sees dfuMANIFEST, or the upload is done
+	double finish_us;						// Bootloader reboots
+	double ftfl_busy_us;
+	unsigned cmd_erase_sector;
+	unsigned cmd_erase_block;
+	unsigned cmd_program_long_word;
+	unsigned cmd_program_section;
+	unsigned cmd_read_1s_section;
+	unsigned cmd_program_check;
+	unsigned cmd_set_flexram;
+	unsigned cmd_errors;					// ACCERR or MGSTAT0
+	unsigned dnload_requests;
+	unsigned getstatus_requests;
+	unsigned busy_polls;					// GETSTATUS answered with dfuDNBUSY or dfuMANIFEST_SYNC
+	unsigned upload_requests;
+	unsigned upload_bytes;
+	unsigned upload_transactions;			// DFU_UPLOAD in the firmware's request statistics
+	unsigned control_naks;					// EP0 data and status transactions NAKed
+	unsigned stream_packets;				// Bulk OUT packets taken by the stream endpoint
+	unsigned stream_naks;
+	unsigned stream_reports;
+	unsigned discarded_packets;				// IN data with the wrong DATA0/1 toggle
+	unsigned read_collisions;
+	unsigned crc_words;						// Long words through the CRC module
+	double suspend_us;						// From the last SOF to the end of resume signaling
+	double vlps_us;
+	unsigned violations;					// Things real hardware wouldn't forgive
+	bool launched;							// Ended by starting the application, not a reboot
+	bool fast_path;							// Started it before main()
+	bool finished;
+	bool failed;
+	char message[160];
+} sim_stats_t;
+
+extern sim_stats_t *sim_stats;
+void sim_violation(const char *format, ...) __attribute__ ((format(printf, 1, 2)));
+
+// FTFL model, sim_ftfl.c
+void sim_ftfl_reset(void);
+void sim_ftfl_read(uint32_t address);
+void sim_ftfl_write(uint32_t address, uint32_t old);
+void sim_ftfl_update(void);
+double sim_ftfl_next_event(void);
+bool sim_ftfl_irq(void);
+
+// USB device controller and DFU host, sim_usb.c
+typedef struct
+{
+	const uint8_t *image;
+	size_t length;
+	uint8_t alternate;
+	bool stream;							// Over the vendor stream interface instead of DFU_DNLOAD
+	bool upload;							// Read the application back instead
+	unsigned suspend_ms;					// Bus suspended this long before the download
+	bool boot;								// Reset without the boot token
+	unsigned refused_block;					// Sent past the end of flash first, then again after DFU_CLRSTATUS, 0 for none
+} sim_download_t;
+
+void sim_usb_reset(const sim_download_t *download);
+void sim_usb_write(uint32_t address, uint32_t old);
+void sim_usb_update(void);
+double sim_usb_next_event(void);
+bool sim_usb_irq(void);
+bool sim_usb_resume_detected(void);			// Asynchronous resume interrupt, wakes VLPS
@@ -0,0 +1,1007 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Host simulator, USB-OTG device controller and a dfu-util style host.
+ *
+ * The device side follows the buffer descriptor table the firmware sets up:
+ * a transaction needs a BDT entry the firmware owns over to the controller
+ * by the time the token arrives. The controller fills it in, hands it back
+ * with the token PID and byte count and advances the even/odd bank. Once
+ * the packet is over it queues the transaction for TOKDNE, in a four entry
+ * FIFO behind USB0_STAT. No buffer, or a full FIFO, is a NAK. EPSTALL answers
+ * with a STALL handshake.
+ *
+ * The host side sends one control transfer at a time, starting each on the
+ * next frame after the previous one finished, and spends full speed bus time
+ * on every transaction. It checks DATA0/DATA1 on everything it receives and
+ * drops packets with the wrong toggle, as a real host does. After reset it
+ * reads the serial number string and checks it against the unique ID in
+ * SIM_UIDH..SIM_UIDL and reads the boot profile, then it runs a
+ * download the way dfu-util does: DFU_DNLOAD, then DFU_GETSTATUS until the
+ * device is back in dfuDNLOAD_IDLE, sleeping bwPollTimeout in between, and
+ * finally a zero length DFU_DNLOAD and DFU_GETSTATUS until dfuMANIFEST.
+ * A run can have one block go out with a number past the end of flash
+ * first. The device has to stall it, then the host clears the error with
+ * DFU_CLRSTATUS and sends the block again.
+ *
+ * An upload reads the application back with DFU_UPLOAD, block by block
+ * until a short one, and compares it with flash. Then it reads the control
+ * request statistics and checks them against what it sent.
+ *
+ * A suspend stops SOFs after SET_INTERFACE, raises SLEEP once the bus has
+ * been idle for 3 ms, and after the suspend time sends resume signaling,
+ * which the firmware has to be ready for by the time it ends.
+ *
+ * A stream download sends STREAM_BEGIN instead, then the image as bulk OUT
+ * packets ending with a short one, polling the bulk IN endpoint for reports
+ * after every OUT transaction, and finishes with DFU_GETSTATUS once a report
+ * says everything is programmed.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "sim_model.h"
+#include "usb_desc.h"
+#include "boot_profile.h"
+
+#define SIM_FRAME_US						1000.0
+#define SIM_BYTE_US							(8.0 / 12.0)	// Full speed
+#define SIM_PACKET_OVERHEAD					13				// Bytes of token, PIDs, CRC, handshake, sync, EOP and gaps
+#define SIM_NAK_RETRY_US					15.0
+#define SIM_PACKET_GAP_US					0.5				// From the end of one transaction to the next token
+#define SIM_STAT_FIFO						4
+#define SIM_HOST_TURNAROUND_US				125.0			// Host software between two control transfers
+#define SIM_ATTACH_DEBOUNCE_US				100000.0
+#define SIM_RESET_US						10000.0
+#define SIM_RESET_RECOVERY_US				10000.0
+#define SIM_SLEEP_DETECT_US					3000.0
+#define SIM_RESUME_US						20000.0
+#define SIM_RESUME_RECOVERY_US				10000.0
+#define SIM_STRING_READ						255				// wLength asked for a string descriptor, as Windows does
+#define SIM_STATS_HEADER					40				// The request statistics in usb_dev.c, header
+#define SIM_STATS_SLOT						24				// and one slot
+#define SIM_STATS_SIZE						(SIM_STATS_HEADER + USB_STATS_SLOTS * SIM_STATS_SLOT)
+
+// Control reads the host makes: a DFU block, a string descriptor or the request statistics
+#define SIM_MAX(a, b)						((a) > (b) ? (a) : (b))
+#define SIM_MIN(a, b)						((a) < (b) ? (a) : (b))
+#define SIM_CONTROL_DATA					SIM_MAX(SIM_MAX(DFU_TRANSFER_SIZE, SIM_STRING_READ), SIM_STATS_SIZE)
+
+#define BDT_OWN								0x80
+#define BDT_DATA1							0x40
+#define PID_OUT								0x1
+#define PID_IN								0x9
+#define PID_SETUP							0xD
+
+// Same layout as bdt_t in usb_dev.c, with host sized pointers
+typedef struct
+{
+	uint32_t desc;
+	void *addr;
+} sim_bdt_t;
+
+typedef enum
+{
+	hsACK,
+	hsNAK,
+	hsSTALL
+} sim_handshake_t;
+
+typedef enum
+{
+	phDETACHED,
+	phDEBOUNCE,
+	phRESET,
+	phTRANSFER,
+	phSTREAM,
+	phSUSPEND,
+	phRESUME,
+	phDONE
+} sim_phase_t;
+
+typedef enum
+{
+	stGET_SERIAL,
+	stBOOT_PROFILE,
+	stSET_CONFIGURATION,
+	stSET_INTERFACE,
+	stGETSTATUS,
+	stCLRSTATUS,
+	stDNLOAD,
+	stDNLOAD_REFUSED,
+	stREFUSED_STATUS,
+	stRETRY,
+	stDNLOAD_STATUS,
+	stDNLOAD_END,
+	stSTREAM_BEGIN,
+	stUPLOAD,
+	stUSB_STATS,
+	stMANIFEST_STATUS
+} sim_step_t;
+
+static struct
+{
+	uint8_t odd[16][2];						// Next bank per endpoint, RX and TX
+	uint8_t stat[SIM_STAT_FIFO];			// Done transactions, the first one is in USB0_STAT
+	unsigned stat_count;
+	uint8_t done_stat;						// Transaction on the bus right now
+	double done_at;
+	double next_sof;
+	double frame_origin;
+	uint16_t frame;
+} usb;
+
+static struct
+{
+	sim_download_t download;
+	sim_phase_t phase;
+	sim_step_t step;
+	double next_at;
+	unsigned block;
+	bool refused;							// The refused block went out
+
+	// Control transfer in progress
+	uint8_t setup[8];
+	uint8_t data[SIM_CONTROL_DATA];
+	uint16_t length;
+	uint16_t offset;
+	bool in;
+	enum { xsSETUP, xsDATA, xsSTATUS } stage;
+	uint8_t toggle;
+
+	// Stream download in progress
+	size_t stream_offset;
+	bool stream_ended;						// Short packet sent
+	uint8_t stream_out_toggle;
+	uint8_t stream_in_toggle;
+	bool stream_poll;						// Next transaction is the bulk IN one
+	unsigned stream_naks;					// In a row
+
+	// Suspend before the download
+	double suspend_start;
+	bool sleep_raised;
+	bool suspended_once;
+} host;
+
+static double transaction_us(unsigned payload)
+{
+	return (payload + SIM_PACKET_OVERHEAD) * SIM_BYTE_US;
+}
+
+static volatile uint8_t *endpoint_control(unsigned endpoint)
+{
+	return sim_alias(SIM_ADDR(USB0_ENDPT0) + endpoint * 4);
+}
+
+static sim_bdt_t *bdt_entry(unsigned endpoint, unsigned tx, unsigned odd)
+{
+	uintptr_t table = ((uint32_t)SIM_REG(USB0_BDTPAGE3) << 24) | ((uint32_t)SIM_REG(USB0_BDTPAGE2) << 16)
+		| ((uint32_t)(SIM_REG(USB0_BDTPAGE1) & 0xFE) << 8);
+	return (sim_bdt_t *)table + ((endpoint << 2) | (tx << 1) | odd);
+}
+
+static void token_done(unsigned endpoint, unsigned tx, unsigned odd, unsigned length)
+{
+	// TOKDNE comes once the packet is over
+	usb.done_stat = (endpoint << 4) | (tx << 3) | (odd << 2);
+	usb.done_at = sim_now + transaction_us(length);
+	usb.odd[endpoint][tx] ^= 1;
+}
+
+static void stat_present(void)
+{
+	if (usb.stat_count)
+	{
+		SIM_REG(USB0_STAT) = usb.stat[0];
+		SIM_REG(USB0_ISTAT) |= USB_ISTAT_TOKDNE;
+	}
+}
+
+static sim_handshake_t device_receive(unsigned endpoint, uint8_t pid, const uint8_t *data, unsigned length, uint8_t toggle)
+{
+	// SETUP or OUT from the host
+	volatile uint8_t *control = endpoint_control(endpoint);
+	unsigned odd = usb.odd[endpoint][0];
+	sim_bdt_t *b = bdt_entry(endpoint, 0, odd);
+
+	if (!(*control & USB_ENDPT_EPRXEN))
+	{
+		sim_fail("endpoint %u OUT isn't enabled", endpoint);
+	}
+	if (pid == PID_SETUP)
+	{
+		// A SETUP can't be refused, and it ends a protocol stall
+		*control &= ~USB_ENDPT_EPSTALL;
+	}
+	else if (*control & USB_ENDPT_EPSTALL)
+	{
+		SIM_REG(USB0_ISTAT) |= USB_ISTAT_STALL;
+		return hsSTALL;
+	}
+
+	if (usb.stat_count >= SIM_STAT_FIFO || !(b->desc & BDT_OWN)
+		|| (pid != PID_SETUP && (SIM_REG(USB0_CTL) & USB_CTL_TXSUSPENDTOKENBUSY)))
+	{
+		return hsNAK;
+	}
+	if (length > ((b->desc >> 16) & 0x3FF))
+	{
+		sim_fail("endpoint %u received %u bytes into a %u byte buffer", endpoint, length, (b->desc >> 16) & 0x3FF);
+	}
+
+	if (length)
+	{
+		memcpy(b->addr, data, length);
+	}
+	b->desc = (length << 16) | (toggle ? BDT_DATA1 : 0) | (pid << 2);
+	if (pid == PID_SETUP)
+	{
+		SIM_REG(USB0_CTL) |= USB_CTL_TXSUSPENDTOKENBUSY;
+	}
+	token_done(endpoint, 0, odd, length);
+	return hsACK;
+}
+
+static sim_handshake_t device_transmit(unsigned endpoint, uint8_t *data, unsigned *length, uint8_t *toggle)
+{
+	// IN from the host
+	volatile uint8_t *control = endpoint_control(endpoint);
+	unsigned odd = usb.odd[endpoint][1];
+	sim_bdt_t *b = bdt_entry(endpoint, 1, odd);
+
+	if (!(*control & USB_ENDPT_EPTXEN))
+	{
+		sim_fail("endpoint %u IN isn't enabled", endpoint);
+	}
+	if (*control & USB_ENDPT_EPSTALL)
+	{
+		SIM_REG(USB0_ISTAT) |= USB_ISTAT_STALL;
+		return hsSTALL;
+	}
+	if (usb.stat_count >= SIM_STAT_FIFO || (SIM_REG(USB0_CTL) & USB_CTL_TXSUSPENDTOKENBUSY) || !(b->desc & BDT_OWN))
+	{
+		return hsNAK;
+	}
+
+	*length = (b->desc >> 16) & 0x3FF;
+	*toggle = (b->desc & BDT_DATA1) ? 1 : 0;
+	if (*length > EP0_SIZE)
+	{
+		sim_fail("endpoint %u transmits %u bytes", endpoint, *length);
+	}
+	if (*length)
+	{
+		memcpy(data, b->addr, *length);
+	}
+	b->desc = (*length << 16) | (PID_IN << 2);
+	token_done(endpoint, 1, odd, *length);
+	return hsACK;
+}
+
+static double next_frame(double at)
+{
+	double frames = (at - usb.frame_origin) / SIM_FRAME_US;
+	long whole = (long)frames;
+
+	if (frames > whole)
+	{
+		whole++;
+	}
+	return usb.frame_origin + whole * SIM_FRAME_US;
+}
+
+static void host_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, double delay_us)
+{
+	// Never ask for more than there is room for
+	if (wLength > sizeof(host.data))
+	{
+		wLength = sizeof(host.data);
+	}
+
+	host.setup[0] = bmRequestType;
+	host.setup[1] = bRequest;
+	host.setup[2] = wValue;
+	host.setup[3] = wValue >> 8;
+	host.setup[4] = wIndex;
+	host.setup[5] = wIndex >> 8;
+	host.setup[6] = wLength;
+	host.setup[7] = wLength >> 8;
+	host.length = wLength;
+	host.offset = 0;
+	host.in = (bmRequestType & 0x80) != 0;
+	host.stage = xsSETUP;
+	host.phase = phTRANSFER;
+	host.next_at = next_frame(sim_now + SIM_HOST_TURNAROUND_US + delay_us);
+}
+
+static void host_getstatus(double delay_us)
+{
+	sim_stats->getstatus_requests++;
+	host_control(0xA1, 3, 0, DFU_INTERFACE, 6, delay_us);
+}
+
+static void host_dnload(void)
+{
+	size_t offset = (size_t)host.block * DFU_TRANSFER_SIZE;
+	size_t length = 0;
+
+	if (offset < host.download.length)
+	{
+		length = host.download.length - offset;
+		if (length > DFU_TRANSFER_SIZE)
+		{
+			length = DFU_TRANSFER_SIZE;
+		}
+		memcpy(host.data, host.download.image + offset, length);
+	}
+
+	host.step = length ? stDNLOAD : stDNLOAD_END;
+	sim_stats->dnload_requests++;
+	if (length && host.block == host.download.refused_block && !host.refused)
+	{
+		// Same data, a block number past the end of flash
+		host.step = stDNLOAD_REFUSED;
+		host.refused = true;
+		host_control(0x21, 1, FLASH_APP_SECTORS * DFU_BLOCKS_PER_SECTOR, DFU_INTERFACE, length, 0);
+		return;
+	}
+	host_control(0x21, 1, host.block, DFU_INTERFACE, length, 0);
+}
+
+static void host_upload(void)
+{
+	host.step = stUPLOAD;
+	sim_stats->upload_requests++;
+	host_control(0xA1, 2, host.block, DFU_INTERFACE, DFU_TRANSFER_SIZE, 0);
+}
+
+static void check_serial_number(void)
+{
+	const uint32_t *uid = &SIM_REG(SIM_UIDH);
+	char expected[SERIAL_NUMBER_LEN + 1];
+
+	snprintf(expected, sizeof(expected), "%08X%08X%08X%08X", uid[0], uid[1], uid[2], uid[3]);
+	if (host.offset != 2 + SERIAL_NUMBER_LEN * 2 || host.data[0] != host.offset || host.data[1] != 3)
+	{
+		sim_fail("serial number descriptor of %u bytes", host.offset);
+	}
+	for (unsigned i = 0; i < SERIAL_NUMBER_LEN; i++)
+	{
+		if (host.data[2 + i * 2] != expected[i] || host.data[3 + i * 2])
+		{
+			sim_fail("serial number doesn't match the unique ID %s", expected);
+		}
+	}
+}
+
+#if USB_STATS
+static void check_usb_stats(void)
+{
+	const uint8_t *d = host.data;
+	unsigned transactions = 0;
+
+	if (host.offset != SIM_STATS_SIZE || d[0] != 1 || d[1] != USB_STATS_SLOTS || d[2] != F_CPU / 1000000)
+	{
+		sim_fail("request statistics header of %u bytes", host.offset);
+	}
+	for (unsigned i = 0; i < USB_STATS_SLOTS; i++)
+	{
+		const uint8_t *r = d + SIM_STATS_HEADER + i * SIM_STATS_SLOT;
+		uint32_t count, min_cycles, max_cycles;
+		memcpy(&count, r + 4, 4);
+		memcpy(&min_cycles, r + 8, 4);
+		memcpy(&max_cycles, r + 12, 4);
+		if (count && min_cycles > max_cycles)
+		{
+			sim_fail("request 0x%04X takes %u to %u cycles", r[0] | (r[1] << 8), min_cycles, max_cycles);
+		}
+		if ((r[0] | (r[1] << 8)) == 0x02A1)
+		{
+			transactions = count;
+		}
+	}
+
+	// SETUP, at least one data and a status transaction per block
+	if (transactions < sim_stats->upload_requests * 3)
+	{
+		sim_fail("%u transactions counted for %u DFU_UPLOAD requests", transactions, sim_stats->upload_requests);
+	}
+	sim_stats->upload_transactions = transactions;
+}
+#endif
+
+static void check_boot_profile(void)
+{
+	boot_profile_t profile;
+
+	if (host.offset != sizeof(profile))
+	{
+		sim_fail("boot profile of %u bytes", host.offset);
+	}
+	memcpy(&profile, host.data, sizeof(profile));
+	if (profile.magic != BOOT_PROFILE_MAGIC || profile.version != BOOT_PROFILE_VERSION ||
+		profile.size != sizeof(profile) || profile.f_cpu != F_CPU)
+	{
+		sim_fail("boot profile header %08X version %u", profile.magic, profile.version);
+	}
+	if (profile.cycles[bpDECIDED] < profile.cycles[bpMAIN] || profile.cycles[bpLAUNCH])
+	{
+		sim_fail("boot profile main() %u, decided %u, launch %u cycles", profile.cycles[bpMAIN],
+			profile.cycles[bpDECIDED], profile.cycles[bpLAUNCH]);
+	}
+}
+
+static void host_suspend(void)
+{
+	// No more SOFs, the bus goes idle
+	usb.next_sof = __builtin_inf();
+	host.suspended_once = true;
+	host.sleep_raised = false;
+	host.suspend_start = sim_now;
+	host.phase = phSUSPEND;
+	host.next_at = sim_now + SIM_SLEEP_DETECT_US;
+}
+
+static void host_transfer_done(void)
+{
+	uint8_t status = host.data[0];
+	uint8_t state = host.data[4];
+	double poll_us = (host.data[1] | (host.data[2] << 8) | (host.data[3] << 16)) * 1000.0;
+
+	switch (host.step)
+	{
+		case stGET_SERIAL:
+			check_serial_number();
+			host.step = stBOOT_PROFILE;
+			host_control(0xC0, BOOT_PROFILE_REQUEST, 0, 0, sizeof(boot_profile_t), 0);
+			break;
+
+		case stBOOT_PROFILE:
+			check_boot_profile();
+			host.step = stSET_CONFIGURATION;
+			host_control(0x00, 9, 1, 0, 0, 0);
+			break;
+
+		case stSET_CONFIGURATION:
+			host.step = stSET_INTERFACE;
+			host_control(0x01, 11, host.download.alternate, DFU_INTERFACE, 0, 0);
+			break;
+
+		case stSET_INTERFACE:
+			if (host.download.suspend_ms && !host.suspended_once)
+			{
+				host_suspend();
+				break;
+			}
+			// Fall through
+		case stCLRSTATUS:
+			host.step = stGETSTATUS;
+			host_getstatus(0);
+			break;
+
+		case stGETSTATUS:
+			if (state == dfuERROR)
+			{
+				host.step = stCLRSTATUS;
+				host_control(0x21, 4, 0, DFU_INTERFACE, 0, 0);
+			}
+#if DFU_STREAM
+			else if (state == dfuIDLE && host.download.stream)
+			{
+				host.step = stSTREAM_BEGIN;
+				host_control(0x41, STREAM_BEGIN, 0, STREAM_INTERFACE, 0, 0);
+			}
+#endif
+			else if (state == dfuIDLE && host.download.upload)
+			{
+				host.block = 0;
+				host_upload();
+			}
+			else if (state == dfuIDLE)
+			{
+				host.block = 0;
+				host_dnload();
+			}
+			else
+			{
+				sim_fail("device is in state %u before the download", state);
+			}
+			break;
+
+		case stDNLOAD:
+			host.step = stDNLOAD_STATUS;
+			host_getstatus(0);
+			break;
+
+		case stDNLOAD_REFUSED:
+			sim_fail("block %u past the end of flash was taken", FLASH_APP_SECTORS * DFU_BLOCKS_PER_SECTOR);
+			break;
+
+		case stREFUSED_STATUS:
+			if (status != errADDRESS || state != dfuERROR)
+			{
+				sim_fail("refused block left status %u state %u", status, state);
+			}
+			host.step = stRETRY;
+			host_control(0x21, 4, 0, DFU_INTERFACE, 0, 0);
+			break;
+
+		case stRETRY:
+			host_dnload();
+			break;
+
+		case stDNLOAD_STATUS:
+			if (status != OK || state == dfuERROR)
+			{
+				sim_fail("block %u failed, status %u state %u", host.block, status, state);
+			}
+			if (state == dfuDNLOAD_IDLE)
+			{
+				host.block++;
+				host_dnload();
+			}
+			else
+			{
+				sim_stats->busy_polls++;
+				host_getstatus(poll_us);
+			}
+			break;
+
+		case stDNLOAD_END:
+			host.step = stMANIFEST_STATUS;
+			host_getstatus(0);
+			break;
+
+		case stSTREAM_BEGIN:
+			host.phase = phSTREAM;
+			break;
+
+		case stUPLOAD:
+		{
+			// Flash, except that the image reads back as it was downloaded,
+			// without what the bootloader programmed into it since
+			size_t offset = (size_t)host.block * DFU_TRANSFER_SIZE;
+			uint8_t expected[DFU_TRANSFER_SIZE];
+
+			memcpy(expected, sim_flash + APP_ORIGIN + offset, host.offset);
+			if (offset < host.download.length)
+			{
+				memcpy(expected, host.download.image + offset, SIM_MIN(host.offset, host.download.length - offset));
+			}
+			if (memcmp(host.data, expected, host.offset))
+			{
+				sim_fail("upload block %u differs from %s", host.block,
+					memcmp(host.data, sim_flash + APP_ORIGIN + offset, host.offset) ? "flash" : "the image");
+			}
+			sim_stats->upload_bytes += host.offset;
+			if (host.offset < DFU_TRANSFER_SIZE)
+			{
+				// Short block, the end of the application area
+				if (sim_stats->upload_bytes != P_FLASH_END + 1 - APP_ORIGIN)
+				{
+					sim_fail("upload ended after %u bytes", sim_stats->upload_bytes);
+				}
+				sim_stats->download_end_us = sim_now;
+#if USB_STATS
+				host.step = stUSB_STATS;
+				host_control(0xC0, USB_STATS_REQUEST, 0, 0, SIM_STATS_SIZE, 0);
+				break;
+#else
+				sim_finish();
+#endif
+			}
+			host.block++;
+			host_upload();
+			break;
+		}
+
+#if USB_STATS
+		case stUSB_STATS:
+			check_usb_stats();
+			sim_finish();
+			break;
+#endif
+
+		case stMANIFEST_STATUS:
+			if (status != OK || state == dfuERROR)
+			{
+				sim_fail("manifestation failed, status %u state %u", status, state);
+			}
+			if (state == dfuMANIFEST || state == dfuMANIFEST_WAIT_RESET)
+			{
+				sim_stats->download_end_us = sim_now;
+				host.phase = phDONE;
+			}
+			else
+			{
+				sim_stats->busy_polls++;
+				host_getstatus(poll_us);
+			}
+			break;
+	}
+}
+
+static void host_transaction(void)
+{
+	sim_handshake_t handshake = hsACK;
+	uint8_t packet[EP0_SIZE];
+	unsigned length = 0;
+	uint8_t toggle = 0;
+	double bus_us = 0;
+
+	switch (host.stage)
+	{
+		case xsSETUP:
+			handshake = device_receive(0, PID_SETUP, host.setup, 8, 0);
+			bus_us = transaction_us(8);
+			if (handshake == hsACK)
+			{
+				// DFU_DNLOAD, STREAM_BEGIN or DFU_UPLOAD
+				if (((host.setup[1] == 1 && (host.setup[0] == 0x21 || host.setup[0] == 0x41)) ||
+					(host.setup[1] == 2 && host.setup[0] == 0xA1)) && !sim_stats->download_start_us)
+				{
+					sim_stats->download_start_us = sim_now;
+				}
+				host.stage = host.length ? xsDATA : xsSTATUS;
+				host.toggle = 1;
+			}
+			break;
+
+		case xsDATA:
+			if (host.in)
+			{
+				handshake = device_transmit(0, packet, &length, &toggle);
+				bus_us = transaction_us(length);
+				if (handshake == hsACK && toggle != host.toggle)
+				{
+					// Acknowledged, then dropped as a retransmission
+					sim_stats->discarded_packets++;
+				}
+				else if (handshake == hsACK)
+				{
+					if (length > host.length - host.offset)
+					{
+						sim_fail("control read of %u bytes overflowed", host.length);
+					}
+					memcpy(host.data + host.offset, packet, length);
+					host.offset += length;
+					host.toggle ^= 1;
+					if (length < EP0_SIZE || host.offset == host.length)
+					{
+						host.stage = xsSTATUS;
+					}
+				}
+			}
+			else
+			{
+				length = host.length - host.offset;
+				if (length > EP0_SIZE)
+				{
+					length = EP0_SIZE;
+				}
+				handshake = device_receive(0, PID_OUT, host.data + host.offset, length, host.toggle);
+				bus_us = transaction_us(length);
+				if (handshake == hsACK)
+				{
+					host.offset += length;
+					host.toggle ^= 1;
+					if (host.offset == host.length)
+					{
+						host.stage = xsSTATUS;
+					}
+				}
+			}
+			break;
+
+		case xsSTATUS:
+			if (host.in)
+			{
+				handshake = device_receive(0, PID_OUT, NULL, 0, 1);
+				bus_us = transaction_us(0);
+			}
+			else
+			{
+				handshake = device_transmit(0, packet, &length, &toggle);
+				bus_us = transaction_us(length);
+				if (handshake == hsACK && !toggle)
+				{
+					sim_stats->discarded_packets++;
+					break;
+				}
+				if (handshake == hsACK && length)
+				{
+					sim_fail("status stage of request 0x%02x%02x carried %u bytes", host.setup[1], host.setup[0], length);
+				}
+			}
+			if (handshake == hsACK)
+			{
+				host.next_at = sim_now + bus_us;
+				host_transfer_done();
+				return;
+			}
+			break;
+	}
+
+	if (handshake == hsSTALL && host.step == stDNLOAD_REFUSED)
+	{
+		// As expected, find out why and clear it
+		host.step = stREFUSED_STATUS;
+		host_getstatus(0);
+		return;
+	}
+	if (handshake == hsSTALL)
+	{
+		sim_fail("request 0x%02x%02x stalled", host.setup[1], host.setup[0]);
+	}
+	if (handshake == hsNAK)
+	{
+		sim_stats->control_naks++;
+	}
+	host.next_at = sim_now + (handshake == hsNAK ? SIM_NAK_RETRY_US : bus_us + SIM_PACKET_GAP_US);
+}
+
+#if DFU_STREAM
+static void host_stream(void)
+{
+	// One transaction at a time, bulk OUT with the image and bulk IN polling
+	// for reports taking turns. When both are NAKed, back off a little.
+	sim_handshake_t handshake;
+	uint8_t packet[STREAM_SIZE];
+	unsigned length = 0;
+	uint8_t toggle = 0;
+
+	if (!host.stream_poll)
+	{
+		length = host.download.length - host.stream_offset;
+		if (length > STREAM_SIZE)
+		{
+			length = STREAM_SIZE;
+		}
+
+		handshake = device_receive(STREAM_RX_ENDPOINT, PID_OUT,
+			host.download.image + host.stream_offset, length, host.stream_out_toggle);
+
+		if (handshake == hsSTALL)
+		{
+			sim_fail("stream stalled at byte %zu", host.stream_offset);
+		}
+		if (handshake == hsACK)
+		{
+			host.stream_offset += length;
+			host.stream_out_toggle ^= 1;
+			host.stream_ended = length < STREAM_SIZE;
+			sim_stats->stream_packets++;
+		}
+		else
+		{
+			sim_stats->stream_naks++;
+			length = 0;
+		}
+	}
+	else
+	{
+		handshake = device_transmit(STREAM_TX_ENDPOINT, packet, &length, &toggle);
+
+		if (handshake == hsSTALL)
+		{
+			sim_fail("stream report endpoint stalled");
+		}
+		if (handshake == hsACK && toggle != host.stream_in_toggle)
+		{
+			sim_stats->discarded_packets++;
+		}
+		else if (handshake == hsACK)
+		{
+			uint8_t status = packet[0];
+			uint8_t state = packet[1];
+			bool flash_idle = packet[2];
+			uint32_t programmed = packet[4] | (packet[5] << 8) | (packet[6] << 16) | ((uint32_t)packet[7] << 24);
+
+			host.stream_in_toggle ^= 1;
+			sim_stats->stream_reports++;
+
+			if (length != DFU_STREAM_REPORT_SIZE || status != OK || state == dfuERROR)
+			{
+				sim_fail("stream report of %u bytes, status %u state %u", length, status, state);
+			}
+			if (host.stream_ended && flash_idle && programmed == host.download.length)
+			{
+				host.step = stMANIFEST_STATUS;
+				host_getstatus(0);
+				return;
+			}
+		}
+		else
+		{
+			length = 0;
+		}
+	}
+
+	if (handshake == hsACK)
+	{
+		host.stream_naks = 0;
+		host.next_at = sim_now + transaction_us(length) + SIM_PACKET_GAP_US;
+	}
+	else
+	{
+		host.stream_naks++;
+		host.next_at = sim_now + (host.stream_naks >= 2 || host.stream_ended ? SIM_NAK_RETRY_US : transaction_us(0) + SIM_PACKET_GAP_US);
+	}
+	host.stream_poll = host.stream_ended || !host.stream_poll;
+}
+#endif
+
+void sim_usb_reset(const sim_download_t *download)
+{
+	memset(&usb, 0, sizeof(usb));
+	memset(&host, 0, sizeof(host));
+	host.download = *download;
+	host.phase = phDETACHED;
+
+	// Unique ID for the serial number string, the same for every run
+	uint32_t *uid = (uint32_t *)&SIM_REG(SIM_UIDH);
+	uid[0] = 0x00000000;
+	uid[1] = 0x00290000;
+	uid[2] = 0x4E453154;
+	uid[3] = 0xB00BD00F;
+	host.next_at = __builtin_inf();
+	usb.next_sof = __builtin_inf();
+	usb.done_at = __builtin_inf();
+}
+
+void sim_usb_update(void)
+{
+	if (host.phase == phDETACHED && (SIM_REG(USB0_CONTROL) & USB_CONTROL_DPPULLUPNONOTG))
+	{
+		host.phase = phDEBOUNCE;
+		host.next_at = sim_now + SIM_ATTACH_DEBOUNCE_US;
+	}
+
+	if (usb.done_at <= sim_now)
+	{
+		if (usb.stat_count < SIM_STAT_FIFO)
+		{
+			usb.stat[usb.stat_count++] = usb.done_stat;
+		}
+		if (usb.stat_count == 1)
+		{
+			stat_present();
+		}
+		usb.done_at = __builtin_inf();
+	}
+
+	while (usb.next_sof <= sim_now)
+	{
+		usb.frame = (usb.frame + 1) & 0x7FF;
+		SIM_REG(USB0_FRMNUML) = usb.frame;
+		SIM_REG(USB0_FRMNUMH) = usb.frame >> 8;
+		if (SIM_REG(USB0_CTL) & USB_CTL_USBENSOFEN)
+		{
+			SIM_REG(USB0_ISTAT) |= USB_ISTAT_SOFTOK;
+		}
+		usb.next_sof += SIM_FRAME_US;
+	}
+
+	if (host.next_at > sim_now)
+	{
+		return;
+	}
+
+	switch (host.phase)
+	{
+		case phDEBOUNCE:
+			SIM_REG(USB0_ISTAT) |= USB_ISTAT_USBRST;
+			host.phase = phRESET;
+			host.next_at = sim_now + SIM_RESET_US;
+			break;
+
+		case phRESET:
+			// Frames start with the end of reset
+			usb.frame_origin = sim_now;
+			usb.next_sof = sim_now;
+			host.step = stGET_SERIAL;
+			host_control(0x80, 6, 0x0303, 0x0409, SIM_STRING_READ, SIM_RESET_RECOVERY_US);
+			break;
+
+		case phTRANSFER:
+			host_transaction();
+			break;
+
+#if DFU_STREAM
+		case phSTREAM:
+			host_stream();
+			break;
+#endif
+
+		case phSUSPEND:
+			if (!host.sleep_raised)
+			{
+				SIM_REG(USB0_ISTAT) |= USB_ISTAT_SLEEP;
+				host.sleep_raised = true;
+				host.next_at = host.suspend_start + host.download.suspend_ms * 1000.0;
+				break;
+			}
+			// Resume signaling, the controller sees it if it's clocked, the
+			// asynchronous detector if it's armed
+			SIM_REG(USB0_ISTAT) |= USB_ISTAT_RESUME;
+			if (SIM_REG(USB0_USBTRC0) & USB_USBTRC_USBRESMEN)
+			{
+				SIM_REG(USB0_USBTRC0) |= USB_USBTRC_USB_RESUME_INT;
+			}
+			host.phase = phRESUME;
+			host.next_at = sim_now + SIM_RESUME_US;
+			break;
+
+		case phRESUME:
+			if (SIM_REG(USB0_USBCTRL) & USB_USBCTRL_SUSP)
+			{
+				sim_fail("transceiver still suspended at the end of resume signaling");
+			}
+			sim_stats->suspend_us = sim_now - host.suspend_start;
+			usb.frame_origin = sim_now;
+			usb.next_sof = sim_now;
+			host.step = stGETSTATUS;
+			host_getstatus(SIM_RESUME_RECOVERY_US);
+			break;
+
+		default:
+			host.next_at = __builtin_inf();
+			break;
+	}
+}
+
+double sim_usb_next_event(void)
+{
+	if (host.phase == phDETACHED && (SIM_REG(USB0_CONTROL) & USB_CONTROL_DPPULLUPNONOTG))
+	{
+		return sim_now;
+	}
+	double next = host.next_at < usb.next_sof ? host.next_at : usb.next_sof;
+	return usb.done_at < next ? usb.done_at : next;
+}
+
+bool sim_usb_irq(void)
+{
+	return (SIM_REG(USB0_ISTAT) & SIM_REG(USB0_INTEN)) != 0 || sim_usb_resume_detected();
+}
+
+bool sim_usb_resume_detected(void)
+{
+	return (SIM_REG(USB0_USBTRC0) & (USB_USBTRC_USBRESMEN | USB_USBTRC_USB_RESUME_INT)) ==
+		(USB_USBTRC_USBRESMEN | USB_USBTRC_USB_RESUME_INT);
+}
+
+void sim_usb_write(uint32_t address, uint32_t old)
+{
+	volatile uint8_t *reg = sim_alias(address);
+	uint8_t before = (uint8_t)old;
+	uint8_t written = *reg;
+
+	if (address == SIM_ADDR(USB0_ISTAT) || address == SIM_ADDR(USB0_ERRSTAT) || address == SIM_ADDR(USB0_OTGISTAT))
+	{
+		// Write 1 to clear
+		*reg = before & ~written;
+
+		// Clearing TOKDNE moves on to the next transaction in the FIFO
+		if (address == SIM_ADDR(USB0_ISTAT) && (before & written & USB_ISTAT_TOKDNE) && usb.stat_count)
+		{
+			memmove(usb.stat, usb.stat + 1, --usb.stat_count);
+			stat_present();
+		}
+	}
+	else if (address == SIM_ADDR(USB0_CTL) && (written & USB_CTL_ODDRST))
+	{
+		memset(usb.odd, 0, sizeof(usb.odd));
+	}
+	else if (address == SIM_ADDR(USB0_USBTRC0))
+	{
+		// The resume flag is read only, disarming the detector clears it
+		written = (written & ~USB_USBTRC_USB_RESUME_INT) | (before & USB_USBTRC_USB_RESUME_INT);
+		if (!(written & USB_USBTRC_USBRESMEN))
+		{
+			written &= ~USB_USBTRC_USB_RESUME_INT;
+		}
+		*reg = written;
+	}
+}
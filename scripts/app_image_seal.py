@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+#
+# Seals an application binary for the bootloader's image check
+# (src/app_image.h): pads it to a whole long word, puts the trailer offset
+# and a sequence number into reserved vector table entries 7 and 8, and
+# appends the trailer with the CRC-32 of everything in front of it.
+#
+# The sequence number has to change with every image. It defaults to the
+# time in seconds, which does.
+#
+# Usage: ./scripts/app_image_seal.py app.bin sealed.bin [--sequence N]
+
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+APP_ORIGIN = 0x2000
+APP_SIZE = 0x40000 - APP_ORIGIN
+
+APP_IMAGE_MAGIC = 0x54474D49
+APP_IMAGE_VECTOR_LENGTH = 7
+APP_IMAGE_VECTOR_SEQUENCE = 8
+APP_IMAGE_UNVERIFIED = 0xFFFFFFFF
+
+TRAILER = struct.Struct("<IIIII")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="append an image trailer for the bootloader")
+    parser.add_argument("input", help="application binary, linked at 0x%X" % APP_ORIGIN)
+    parser.add_argument("output", help="sealed binary, to download with dfu-util")
+    parser.add_argument("--sequence", type=lambda x: int(x, 0), default=int(time.time()),
+                        help="image sequence number, default the time in seconds")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as f:
+        image = bytearray(f.read())
+
+    if args.sequence < 0 or args.sequence >= APP_IMAGE_UNVERIFIED:
+        print("sequence number out of range")
+        return 1
+
+    image += b"\xff" * (-len(image) % 4)
+    if len(image) <= APP_IMAGE_VECTOR_SEQUENCE * 4 or len(image) + TRAILER.size > APP_SIZE:
+        print("%s: %u bytes, doesn't fit the application area with a trailer" % (args.input, len(image)))
+        return 1
+
+    struct.pack_into("<I", image, APP_IMAGE_VECTOR_LENGTH * 4, len(image))
+    struct.pack_into("<I", image, APP_IMAGE_VECTOR_SEQUENCE * 4, args.sequence)
+    crc = zlib.crc32(image) & 0xFFFFFFFF
+    image += TRAILER.pack(APP_IMAGE_MAGIC, args.sequence, len(image), crc, APP_IMAGE_UNVERIFIED)
+
+    with open(args.output, "wb") as f:
+        f.write(image)
+
+    print("%s: %u bytes, sequence %u, CRC-32 %08X" % (args.output, len(image), args.sequence, crc))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+#
+# Reads where the time went between reset and DFU mode, from the boot
+# profile the bootloader keeps in RAM (src/boot_profile.h). Needs pyusb.
+#
+# Usage: ./scripts/boot_profile.py [-d VID:PID] [-S serial]
+
+import argparse
+import struct
+import sys
+
+import usb.core
+
+BOOT_PROFILE_REQUEST = 0x03
+BOOT_PROFILE_MAGIC = 0x50544F42
+
+HEADER = struct.Struct("<IHHI")
+
+# Name and core clock of the time leading up to each phase
+FLL_HZ = 20971520
+CRYSTAL_HZ = 16000000
+PHASES = [
+    ("fast path checks", FLL_HZ),
+    ("crystal running", FLL_HZ),
+    ("PLL locked", CRYSTAL_HZ),
+    ("clocks up", CRYSTAL_HZ),
+    ("main()", None),
+    ("boot decided", None),
+    ("application", None),
+]
+
+
+def find_device(vid, pid, serial):
+    for dev in usb.core.find(find_all=True, idVendor=vid, idProduct=pid):
+        if serial is None or dev.serial_number == serial:
+            return dev
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="bootloader boot profile")
+    parser.add_argument("-d", "--device", default="0000:0000", help="VID:PID, default 0000:0000")
+    parser.add_argument("-S", "--serial", help="pick a board by its serial number")
+    args = parser.parse_args()
+
+    vid, pid = (int(x, 16) for x in args.device.split(":"))
+    dev = find_device(vid, pid, args.serial)
+    if dev is None:
+        print("no bootloader found on %s" % args.device)
+        return 1
+
+    data = bytes(dev.ctrl_transfer(0xC0, BOOT_PROFILE_REQUEST, 0, 0, 64))
+    magic, version, size, f_cpu = HEADER.unpack_from(data)
+    if magic != BOOT_PROFILE_MAGIC or version != 1:
+        print("no boot profile, magic %08X version %u" % (magic, version))
+        return 1
+
+    cycles = struct.unpack_from("<%uI" % len(PHASES), data, HEADER.size)
+
+    print("%-18s %10s %10s %10s" % ("phase", "cycles", "+us", "us"))
+    last_cycles = 0
+    us = 0.0
+    for (name, hz), stamp in zip(PHASES, cycles):
+        if not stamp:
+            continue
+        step = (stamp - last_cycles) * 1e6 / (hz or f_cpu)
+        us += step
+        print("%-18s %10u %10.1f %10.1f" % (name, stamp, step, us))
+        last_cycles = stamp
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
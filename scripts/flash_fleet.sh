@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# Downloads one image into every bootloader on the bus at the same time.
+# Each bootloader reports its chip's unique ID as the USB serial number,
+# dfu-util -S picks a device by it. One log per device ends up in
+# fleet_logs/<serial>.log.
+#
+# Usage: ./scripts/flash_fleet.sh firmware.bin [more dfu-util options]
+#
+# DEVICE and ALT in the environment override the VID:PID and the DFU
+# alternate setting, e.g. ALT=1 for a full replace.
+
+if [ -z "$1" ]; then
+	echo "usage: $0 firmware.bin [dfu-util options]"
+	exit 2
+fi
+
+IMAGE="$1"
+shift
+
+DEVICE="${DEVICE:-0000:0000}"
+ALT="${ALT:-0}"
+LOG_DIR="./fleet_logs"
+
+SERIALS=$(dfu-util -l -d "$DEVICE" 2>/dev/null | sed -n 's/.*serial="\([^"]*\)".*/\1/p' | sort -u)
+
+if [ -z "$SERIALS" ]; then
+	echo "no bootloaders found on $DEVICE"
+	exit 1
+fi
+
+mkdir -p "$LOG_DIR"
+
+declare -A PIDS
+for SERIAL in $SERIALS; do
+	dfu-util -d "$DEVICE" -S "$SERIAL" -a "$ALT" -D "$IMAGE" "$@" > "$LOG_DIR/$SERIAL.log" 2>&1 &
+	PIDS[$SERIAL]=$!
+done
+
+echo "flashing $(echo "$SERIALS" | wc -l) devices"
+
+FAILED=0
+for SERIAL in $SERIALS; do
+	if wait "${PIDS[$SERIAL]}"; then
+		echo "  $SERIAL ok"
+	else
+		echo "  $SERIAL FAILED, see $LOG_DIR/$SERIAL.log"
+		FAILED=$((FAILED + 1))
+	fi
+done
+
+if [ $FAILED -ne 0 ]; then
+	echo "$FAILED failed"
+	exit 1
+fi
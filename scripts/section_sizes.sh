@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+# Size of every section in the bootloader ELF, and how full boot flash and
+# RAM are. .dtext runs from RAM but its image is stored in boot flash after
+# .launch, so it counts against both.
+#
+# Usage: ./scripts/section_sizes.sh build/bootloader.elf [size command]
+
+if [ -z "$1" ]; then
+	echo "usage: $0 bootloader.elf [arm-none-eabi-size]"
+	exit 2
+fi
+
+SIZE="${2:-arm-none-eabi-size}"
+
+"$SIZE" -A "$1" | awk '
+	function region(addr) {
+		if (addr < 8192) return "boot flash"
+		if (addr < 262144) return "app flash"
+		if (addr >= 335544320 && addr < 335546368) return "FlexRAM"
+		if (addr >= 536838144 && addr < 536903680) return "RAM"
+		return ""
+	}
+
+	# Debug info and attributes sit at address 0 but never reach the chip
+	$1 ~ /^\.(debug|comment|ARM)/ { next }
+
+	$1 ~ /^\./ && $2 ~ /^[0-9]+$/ {
+		where = region($3)
+		if (where == "" || $2 == 0) next
+		printf "  %-22s %-10s 0x%08x %7u\n", $1, where, $3, $2
+		if (where == "boot flash") flash += $2
+		if (where == "RAM") ram += $2
+		if ($1 == ".dtext") {
+			flash += $2
+			dtext = $2
+		}
+	}
+
+	END {
+		printf "  boot flash %6u of %6u bytes, %5.1f%%\n", flash, 8192, flash * 100 / 8192
+		printf "  RAM        %6u of %6u bytes, %5.1f%%\n", ram, 65536, ram * 100 / 65536
+		printf "  copied to RAM on the way into DFU mode: %u bytes\n", dtext
+		if (flash > 8192) exit 1
+	}
+'
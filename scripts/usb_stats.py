@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+#
+# Reads the bootloader's control request statistics: how many cycles each
+# request spends in usb_isr from TOKDNE until the buffer descriptor goes
+# back to the controller, per transaction, plus STALL and bus error counts.
+# Needs pyusb.
+#
+# Usage: ./scripts/usb_stats.py [-d VID:PID] [-S serial] [--clear]
+
+import argparse
+import struct
+import sys
+
+import usb.core
+
+USB_STATS_REQUEST = 0x02
+
+HEADER = struct.Struct("<BBBBI8I")
+ENTRY = struct.Struct("<HHIIIQ")
+
+REQUESTS = {
+    0x0080: "GET_STATUS",
+    0x0500: "SET_ADDRESS",
+    0x0680: "GET_DESCRIPTOR",
+    0x0880: "GET_CONFIGURATION",
+    0x0900: "SET_CONFIGURATION",
+    0x0A81: "GET_INTERFACE",
+    0x0B01: "SET_INTERFACE",
+    0x0121: "DFU_DNLOAD",
+    0x02A1: "DFU_UPLOAD",
+    0x03A1: "DFU_GETSTATUS",
+    0x0421: "DFU_CLRSTATUS",
+    0x05A1: "DFU_GETSTATE",
+    0x0621: "DFU_ABORT",
+    0x7EC0: "MSFT descriptor",
+    0x7EC1: "MSFT descriptor",
+    (USB_STATS_REQUEST << 8) | 0xC0: "statistics",
+    0xFFFF: "everything else",
+}
+
+ERRSTAT = ["PIDERR", "CRC5EOF", "CRC16", "DFN8", "BTOERR", "DMAERR", "bit 6", "BTSERR"]
+
+BAR_WIDTH = 40
+
+
+def find_device(vid, pid, serial):
+    for dev in usb.core.find(find_all=True, idVendor=vid, idProduct=pid):
+        if serial is None or dev.serial_number == serial:
+            return dev
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="USB control request statistics")
+    parser.add_argument("-d", "--device", default="0000:0000", help="VID:PID, default 0000:0000")
+    parser.add_argument("-S", "--serial", help="pick a board by its serial number")
+    parser.add_argument("--clear", action="store_true", help="start counting over after reading")
+    args = parser.parse_args()
+
+    vid, pid = (int(x, 16) for x in args.device.split(":"))
+    dev = find_device(vid, pid, args.serial)
+    if dev is None:
+        print("no bootloader found on %s" % args.device)
+        return 1
+
+    data = bytes(dev.ctrl_transfer(0xC0, USB_STATS_REQUEST, 0, 0, 4096))
+    if args.clear:
+        dev.ctrl_transfer(0x40, USB_STATS_REQUEST, 0, 0, None)
+
+    version, slots, cpu_mhz, _, stalls, *errors = HEADER.unpack_from(data)
+    if version != 1:
+        print("unknown statistics version %u" % version)
+        return 1
+
+    entries = []
+    for i in range(slots):
+        request, _, count, min_cycles, max_cycles, total_cycles = ENTRY.unpack_from(data, HEADER.size + i * ENTRY.size)
+        if count:
+            entries.append((request, count, min_cycles, max_cycles, total_cycles))
+
+    total = sum(e[4] for e in entries) or 1
+    us = lambda cycles: cycles / cpu_mhz
+
+    print("%-20s %8s %9s %9s %9s %11s" % ("request", "count", "min us", "avg us", "max us", "total us"))
+    for request, count, min_cycles, max_cycles, total_cycles in sorted(entries, key=lambda e: -e[4]):
+        name = REQUESTS.get(request, "0x%04X" % request)
+        bar = "#" * round(total_cycles * BAR_WIDTH / total)
+        print("%-20s %8u %9.2f %9.2f %9.2f %11.1f %s" % (name, count, us(min_cycles),
+              us(total_cycles / count), us(max_cycles), us(total_cycles), bar))
+
+    print("\n%u STALLs" % stalls)
+    bus_errors = ["%s %u" % (name, n) for name, n in zip(ERRSTAT, errors) if n]
+    print("bus errors: %s" % (", ".join(bus_errors) if bus_errors else "none"))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,149 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Application image check against its trailer, see app_image.h.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "kinetis.h"
+#include "dfu.h"
+#include "app_image.h"
+
+// In flash with the rest of the launch path, boot_fast_path() calls them
+__attribute__ ((section(".launch")))
+bool app_image_sealed(void)
+{
+	uint32_t length = ((const uint32_t *)FLASH_PTR(APP_ORIGIN))[APP_IMAGE_VECTOR_LENGTH];
+
+	// Past the entries the tool fills in, and the trailer fits in flash
+	return length > APP_IMAGE_VECTOR_SEQUENCE * 4 && !(length & 3) &&
+		length <= P_FLASH_END + 1 - APP_ORIGIN - sizeof(app_image_trailer_t);
+}
+
+__attribute__ ((section(".launch")))
+const app_image_trailer_t *app_image_trailer(void)
+{
+	const uint32_t *vectors = FLASH_PTR(APP_ORIGIN);
+	uint32_t length = vectors[APP_IMAGE_VECTOR_LENGTH];
+	const app_image_trailer_t *trailer;
+
+	if (!app_image_sealed())
+	{
+		return NULL;
+	}
+
+	trailer = FLASH_PTR(APP_ORIGIN + length);
+	if (trailer->magic != APP_IMAGE_MAGIC || trailer->length != length ||
+		trailer->sequence != vectors[APP_IMAGE_VECTOR_SEQUENCE] || trailer->sequence == APP_IMAGE_UNVERIFIED)
+	{
+		return NULL;
+	}
+	return trailer;
+}
+
+// Also in flash, boot_launch() uses it for the handoff block
+__attribute__ ((section(".launch")))
+uint32_t app_image_crc32(const uint32_t *data, uint32_t length)
+{
+	uint32_t crc;
+
+	SIM_SCGC6 |= SIM_SCGC6_CRC;
+	CRC_CTRL = APP_IMAGE_CRC_CTRL;
+	CRC_GPOLY = APP_IMAGE_CRC_POLY;
+	CRC_CTRL = APP_IMAGE_CRC_CTRL | CRC_CTRL_WAS;
+	CRC_CRC = APP_IMAGE_CRC_SEED;
+	CRC_CTRL = APP_IMAGE_CRC_CTRL;
+
+	// One store per long word, the module keeps up with the flash
+	for (uint32_t words = length / 4; words; words--)
+	{
+		CRC_CRC = *data++;
+	}
+	crc = CRC_CRC;
+
+	// Back the way reset had it, for the application
+	CRC_CTRL = 0;
+	SIM_SCGC6 &= ~SIM_SCGC6_CRC;
+	return crc;
+}
+
+#if APP_IMAGE_CHECK
+static void app_image_program_word(uint32_t address, uint32_t value)
+{
+	// Synchronous, nothing else uses the FTFL before dfu_init()
+	while (!(FTFL_FSTAT & FTFL_FSTAT_CCIF));
+
+	FTFL_FSTAT = FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL | FTFL_FSTAT_RDCOLERR;
+	FTFL_FCCOB0 = FTFL_CMD_PROGRAM_LONG_WORD;
+	FTFL_FCCOB1 = (uint8_t)(address >> 16);
+	FTFL_FCCOB2 = (uint8_t)(address >> 8);
+	FTFL_FCCOB3 = (uint8_t)address;
+	FTFL_FCCOB4 = (uint8_t)(value >> 24);	// Byte at address + 3
+	FTFL_FCCOB5 = (uint8_t)(value >> 16);
+	FTFL_FCCOB6 = (uint8_t)(value >> 8);
+	FTFL_FCCOB7 = (uint8_t)value;			// Byte at address
+	FTFL_FSTAT = FTFL_FSTAT_CCIF;
+
+	while (!(FTFL_FSTAT & FTFL_FSTAT_CCIF));
+
+	// So the application reads what is in the array now
+	FMC_PFB0CR |= FMC_PFB0CR_CINV_WAY_ALL | FMC_PFB0CR_S_B_INV;
+}
+
+__attribute__ ((section(".launch")))
+bool app_image_cached(void)
+{
+	const app_image_trailer_t *trailer = app_image_trailer();
+
+	// Nothing to check in an unsealed image
+	if (!app_image_sealed())
+	{
+		return true;
+	}
+	return trailer && trailer->verified == trailer->sequence;
+}
+
+bool app_image_check(void)
+{
+	const app_image_trailer_t *trailer = app_image_trailer();
+
+	if (!app_image_sealed())
+	{
+		return true;
+	}
+	if (!trailer)
+	{
+		// Sealed, but the trailer doesn't match, e.g. a download stopped partway
+		return false;
+	}
+	if (trailer->verified == trailer->sequence)
+	{
+		return true;
+	}
+	if (app_image_crc32(FLASH_PTR(APP_ORIGIN), trailer->length) != trailer->crc)
+	{
+		return false;
+	}
+
+	// Cache the result. Where programming fails, say with the application
+	// area protected, verified stays erased and every boot runs the CRC.
+	if (trailer->verified == APP_IMAGE_UNVERIFIED)
+	{
+		app_image_program_word(APP_ORIGIN + trailer->length + offsetof(app_image_trailer_t, verified), trailer->sequence);
+	}
+	return true;
+}
+#else
+__attribute__ ((section(".launch")))
+bool app_image_cached(void)
+{
+	return true;
+}
+
+bool app_image_check(void)
+{
+	return true;
+}
+#endif
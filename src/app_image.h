@@ -0,0 +1,87 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Application image trailer, and the check that the whole image is intact.
+ *
+ * scripts/app_image_seal.py appends a trailer to the application binary. It
+ * holds the CRC-32 (the zlib one) of everything in front of it, and a
+ * sequence number that is new for every image. The tool also puts the
+ * trailer's offset and the sequence number into two of the vector table
+ * entries the Cortex-M4 leaves reserved, so the bootloader finds the trailer
+ * without knowing how long the image is, and an image whose first sectors
+ * are new but whose trailer is still the old one doesn't pass.
+ *
+ * The CRC module checks the image on the first boot after it changed, then
+ * the bootloader programs verified in the trailer with the sequence number.
+ * Boots after that only look at the trailer. A download that changes the
+ * image rewrites the trailer sector, which erases verified again.
+ *
+ * Images that were never sealed still boot on the reset vector check alone.
+ * The vector table tells them apart: in a plain build entry 7 is 0 or a
+ * handler address with the Thumb bit set, never a plausible trailer offset.
+ * An image whose entry 7 is one has to have the trailer that goes with it,
+ * so a sealed image with only its first sector updated still doesn't boot.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// With 0 the vector check in test_app_missing() is all there is, even for
+// sealed images.
+#ifndef APP_IMAGE_CHECK
+#define APP_IMAGE_CHECK						1
+#endif
+
+#define APP_IMAGE_MAGIC						0x54474D49	// "IMGT"
+
+// Reserved entries in the application's vector table
+#define APP_IMAGE_VECTOR_LENGTH				7			// Where the trailer starts, from APP_ORIGIN
+#define APP_IMAGE_VECTOR_SEQUENCE			8			// The trailer's sequence number
+
+// verified before the bootloader has checked the image, as the tool leaves it
+#define APP_IMAGE_UNVERIFIED				0xFFFFFFFF
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t sequence;						// Never APP_IMAGE_UNVERIFIED
+	uint32_t length;						// Bytes the CRC covers, from APP_ORIGIN, a multiple of 4
+	uint32_t crc;
+	uint32_t verified;						// sequence once the CRC checked out
+} app_image_trailer_t;
+
+// CRC module setup for the zlib CRC-32. The module shifts MSB first, so
+// writes are bit reversed as a whole long word, which feeds it each byte
+// LSB first starting with the lowest address, and the result is reversed
+// back and inverted on the way out. kinetis.h only has the registers.
+#define CRC_CTRL_TOT(n)						((uint32_t)(n) << 30)	// Transpose writes: 2 bits and bytes
+#define CRC_CTRL_TOTR(n)					((uint32_t)(n) << 28)	// Transpose reads
+#define CRC_CTRL_FXOR						((uint32_t)1 << 26)		// Invert reads
+#define CRC_CTRL_WAS						((uint32_t)1 << 25)		// Writes are the seed
+#define CRC_CTRL_TCRC						((uint32_t)1 << 24)		// 32 bit CRC
+
+#define APP_IMAGE_CRC_CTRL					(CRC_CTRL_TOT(2) | CRC_CTRL_TOTR(2) | CRC_CTRL_FXOR | CRC_CTRL_TCRC)
+#define APP_IMAGE_CRC_POLY					0x04C11DB7
+#define APP_IMAGE_CRC_SEED					0xFFFFFFFF
+
+// True if vector table entry 7 is a plausible trailer offset, i.e. the
+// image was sealed and has to pass the check
+bool app_image_sealed(void);
+
+// The trailer, if the vector table points at a plausible one
+const app_image_trailer_t *app_image_trailer(void);
+
+// The zlib CRC-32 of length bytes, a multiple of 4, through the CRC module.
+// In flash, for the launch path as well.
+uint32_t app_image_crc32(const uint32_t *data, uint32_t length);
+
+// True if this image was checked on an earlier boot, or isn't sealed. Only
+// reads flash, so boot_fast_path() can call it before anything is in RAM.
+bool app_image_cached(void);
+
+// True if the image is intact, or isn't sealed. Runs the CRC unless the
+// result is cached, and caches it when it checks out. From RAM only, it
+// may program flash.
+bool app_image_check(void);
@@ -0,0 +1,58 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * What the bootloader hands the application along with the CPU.
+ *
+ * Written right before the branch to the application, at BOOT_HANDOFF_ADDRESS
+ * below the boot profile. It says how the clocks are set up, why the chip
+ * reset and which bootloader started the application. An application that
+ * finds a valid block, in the MCG mode it wants and with its own F_CPU and
+ * F_BUS, can skip its clock setup. Valid means the magic, version and size
+ * match and the CRC-32 (the zlib one) of everything before crc is right.
+ * ResetHandler clears the magic first thing, so a block from an earlier
+ * boot never looks valid.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#pragma once
+#include <stdint.h>
+
+#define BOOT_HANDOFF_MAGIC					0x46464F48	// "HOFF"
+#define BOOT_HANDOFF_VERSION				1
+#define BOOTLOADER_VERSION					0x0100		// BCD, 1.00
+
+// 64 bytes below the boot profile, the linker script keeps the stack out of them
+#define BOOT_HANDOFF_ADDRESS				0x20007F7C
+
+// MCG_S[CLKST], MCG_S[IREFST] and MCG_S[PLLST] at the branch
+typedef enum
+{
+	bmFEI,									// Reset clocks, the FLL at about 20.97 MHz
+	bmFEE,
+	bmFBI,
+	bmFBE,
+	bmPBE,
+	bmPEE									// The PLL from the 16 MHz crystal
+} boot_mcg_mode_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;							// sizeof(boot_handoff_t)
+	uint16_t bootloader_version;
+	uint8_t mcg_mode;						// boot_mcg_mode_t
+	uint8_t reserved;
+	uint8_t rcm_srs0;						// Reset cause
+	uint8_t rcm_srs1;
+	uint16_t reserved2;
+	uint32_t f_cpu;							// Hz, 0 when the bootloader can't tell
+	uint32_t f_bus;
+	uint32_t f_flash;
+	uint32_t sim_clkdiv1;
+	uint32_t sim_clkdiv2;
+	uint32_t launch_cycles;					// ARM_DWT_CYCCNT at the branch, from reset
+	uint32_t crc;
+} boot_handoff_t;
+
+extern boot_handoff_t boot_handoff;
@@ -0,0 +1,49 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Boot phase timestamps, for the bootloader and the application.
+ *
+ * ResetHandler zeroes the DWT cycle counter on entry, then every phase of
+ * the boot stores ARM_DWT_CYCCNT in a record just below boot_token at the
+ * top of RAM. The application can read it at BOOT_PROFILE_ADDRESS before its
+ * stack grows that far, DFU mode sends it in reply to BOOT_PROFILE_REQUEST,
+ * see scripts/boot_profile.py.
+ *
+ * The counter runs on the core clock: the FLL at about 20.97 MHz up to
+ * bpCRYSTAL, the 16 MHz crystal up to bpCLOCKS and f_cpu from there on.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#pragma once
+#include <stdint.h>
+
+#define BOOT_PROFILE_MAGIC					0x50544F42	// "BOTP"
+#define BOOT_PROFILE_VERSION				1
+
+// 64 bytes below boot_token, the linker script keeps the stack out of them
+#define BOOT_PROFILE_ADDRESS				0x20007FBC
+
+typedef enum
+{
+	bpFAST_PATH,							// boot_fast_path() checked the vectors, the token, the trailer and the pin
+	bpCRYSTAL,								// Crystal running, the core on it (FBE)
+	bpPLL_LOCK,								// PLL locked, .dtext copied to RAM on the way to DFU mode (PBE)
+	bpCLOCKS,								// The PLL drives the core (PEE)
+	bpMAIN,									// main() entered
+	bpDECIDED,								// main() checked them again, and the image CRC where it had to
+	bpLAUNCH,								// Branching to the application
+	BOOT_PHASES
+} boot_phase_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;							// sizeof(boot_profile_t)
+	uint32_t f_cpu;
+	uint32_t cycles[BOOT_PHASES];			// 0 for phases this boot didn't go through
+} boot_profile_t;
+
+extern boot_profile_t boot_profile;
+
+#define BOOT_PROFILE_MARK(phase)			(boot_profile.cycles[phase] = ARM_DWT_CYCCNT)
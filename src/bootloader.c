@@ -23,20 +23,58 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "kinetis.h"
 #include "dfu.h"
 #include "usb_dev.h"
 //#include "serial.h"
 #include "core_pins.h"
 #include "led_functions.h"
+#include "timebase.h"
+#include "boot_profile.h"
+#include "boot_handoff.h"
+#include "app_image.h"
 
 //#define BOOT_PIN 3
 #define BOOT_PIN 32
+#define BOOT_PIN_SETTLE_US 20
+
+// Decide on the application straight from reset, see boot_fast_path(). With
+// 0 every boot brings up the clocks and RAM first and main() decides.
+#ifndef BOOT_FAST_PATH
+#define BOOT_FAST_PATH 1
+#endif
+
+// With 0 the fast path starts the application on the clocks reset left, FEI,
+// with boot_handoff saying so. With 1 it lets ResetHandler bring up the
+// crystal and PLL first, without the copy to RAM, and the application starts
+// at F_CPU after waiting for them.
+#ifndef BOOT_LAUNCH_CLOCKS
+#define BOOT_LAUNCH_CLOCKS 0
+#endif
+
+// MCGOUTCLK in FEI, 640 times the 32.768 kHz slow internal reference
+#define FEI_MCGOUT_HZ 20971520
+#define CRYSTAL_HZ 16000000
+
+// Out of reset the core runs from the FLL at 20.97 MHz, 25 MHz at most
+#define RESET_CYCLES_PER_US 25
+
+#define BOOT_PIN_REG_(pin, reg) CORE_PIN ## pin ## _ ## reg
+#define BOOT_PIN_REG(pin, reg) BOOT_PIN_REG_(pin, reg)
+
+// Longest we wait for the host to collect the status that said dfuMANIFEST
+#define MANIFEST_LINGER_MS 50
+
+// Off the bus before the reboot. The hub latches the disconnect within
+// microseconds, this leaves it plenty of margin.
+#define DETACH_MS 10
 
 extern uint32_t boot_token;
+extern void launch_application(uint32_t stack_pointer, uint32_t entry_point);
 static __attribute__ ((section(".applicationInterruptVectors"))) uint32_t applicationInterruptVectors[NVIC_NUM_INTERRUPTS+16];
 
-static bool test_boot_token()
+static inline __attribute__ ((always_inline)) bool test_boot_token()
 {
     /*
      * If we find a valid boot token in RAM, the application is asking us explicitly
@@ -47,21 +85,21 @@ static bool test_boot_token()
     return boot_token == 0xDEADBEEF;
 }
 
-static bool test_app_missing()
+static inline __attribute__ ((always_inline)) bool test_app_missing()
 {
     /*
      * If there doesn't seem to be a valid application installed, we always go to
      * bootloader mode.
      */
 
-    uint32_t ivt_entry_point = applicationInterruptVectors[1];
+    uint32_t ivt_entry_point = ((const uint32_t *)FLASH_PTR(APP_ORIGIN))[1];
 	
 	// Returns true if the contents of 1st address of the vector table (which is the arm program counter)
 	// point to an address in the bootloader ( < APP_ORIGIN ) or return true if the contents point to an 
 	// address outside the application flash area (eg, 0xFFFFFFFF).
 	
-	// Granted this relies in the linker actually respecting our request to place applicationInterruptVectors[0]
-	// at APP_ORIGIN so maybe it's risky...
+	// Read at APP_ORIGIN through FLASH_PTR like the rest of the image checks, the host simulator
+	// has no flash at the address applicationInterruptVectors links to.
 	
     return (ivt_entry_point < APP_ORIGIN) || (ivt_entry_point >= (256 * 1024));
 }
@@ -70,10 +108,8 @@ static bool test_boot_pin_low()
 {
 	pinMode(BOOT_PIN, INPUT_PULLUP);
 	
-    for (int j = 1000; j; --j)
-    {
-		__asm__ volatile ("nop");;
-    }
+	// Give the pull-up time to charge the pin
+	timebase_delay_us(BOOT_PIN_SETTLE_US);
 		
 	if(digitalRead(BOOT_PIN) == 0)
 	{
@@ -85,111 +121,200 @@ static bool test_boot_pin_low()
 	}
 }
 
-static void app_launch()
+static __attribute__ ((section(".launch"))) void handoff_write(void)
+{
+    uint8_t s = MCG_S;
+    uint32_t clkdiv1 = SIM_CLKDIV1;
+    uint32_t mcgout;
+
+    if ((s & MCG_S_CLKST_MASK) == MCG_S_CLKST(3)) {
+        boot_handoff.mcg_mode = bmPEE;
+        mcgout = F_CPU * (((clkdiv1 >> 28) & 0xF) + 1);
+    } else if ((s & MCG_S_CLKST_MASK) == MCG_S_CLKST(2)) {
+        boot_handoff.mcg_mode = (s & MCG_S_PLLST) ? bmPBE : bmFBE;
+        mcgout = CRYSTAL_HZ;
+    } else if ((s & MCG_S_CLKST_MASK) == MCG_S_CLKST(1)) {
+        boot_handoff.mcg_mode = bmFBI;
+        mcgout = 0;
+    } else {
+        boot_handoff.mcg_mode = (s & MCG_S_IREFST) ? bmFEI : bmFEE;
+        mcgout = (s & MCG_S_IREFST) ? FEI_MCGOUT_HZ : 0;
+    }
+
+    boot_handoff.version = BOOT_HANDOFF_VERSION;
+    boot_handoff.size = sizeof(boot_handoff);
+    boot_handoff.bootloader_version = BOOTLOADER_VERSION;
+    boot_handoff.reserved = 0;
+    boot_handoff.rcm_srs0 = RCM_SRS0;
+    boot_handoff.rcm_srs1 = RCM_SRS1;
+    boot_handoff.reserved2 = 0;
+    boot_handoff.f_cpu = mcgout / (((clkdiv1 >> 28) & 0xF) + 1);
+    boot_handoff.f_bus = mcgout / (((clkdiv1 >> 24) & 0xF) + 1);
+    boot_handoff.f_flash = mcgout / (((clkdiv1 >> 16) & 0xF) + 1);
+    boot_handoff.sim_clkdiv1 = clkdiv1;
+    boot_handoff.sim_clkdiv2 = SIM_CLKDIV2;
+    boot_handoff.launch_cycles = BOOT_PROFILE_MARK(bpLAUNCH);
+    boot_handoff.magic = BOOT_HANDOFF_MAGIC;
+    // Same CRC module setup as the image check, crc sits on a long word boundary
+    boot_handoff.crc = app_image_crc32((const uint32_t *)&boot_handoff, offsetof(boot_handoff_t, crc));
+}
+
+// Into the application, from either path. In flash, ResetHandler calls it
+// before anything is in RAM.
+__attribute__ ((section(".launch")))
+void boot_launch(void)
 {
     // Relocate IVT to application flash
-    __disable_irq();
     SCB_VTOR = (uint32_t) &applicationInterruptVectors[0];
 
     // Clear the boot token, so we don't repeatedly enter DFU mode.
     boot_token = 0;
 
-    asm volatile (
-	
-		// Fill the return address with 0xFFFFFFFF (we should never return to bootloader)
-        "mov lr, %0 \n\t"
-		
-		// Set the stack pointer to Application IVT entry 0
-        "mov sp, %1 \n\t"
-		
-		// Branch to program counter in Application IVT entry 1
-        "bx %2 \n\t"
-		
-		// Corresponding data
-        : : "r" (0xFFFFFFFF),
-            "r" (applicationInterruptVectors[0]),
-            "r" (applicationInterruptVectors[1]) );
+    handoff_write();
+
+    // Stack pointer from Application IVT entry 0, program counter from entry 1
+    launch_application(applicationInterruptVectors[0], applicationInterruptVectors[1]);
 }
 
+static void app_launch()
+{
+    __disable_irq();
+    timebase_stop();
+    boot_launch();
+}
 
-int main()
-{	
-    uint32_t i = 0;
-    led_init();
 
-    // LED helps us see what's happening, stays on during download, blinks otherwise
-    while(1) {
-    if ((i % 100000) == 0)
-    {
-        led_clear();
-    }
-    if ((i % 1000000) == 0)
+#if BOOT_FAST_PATH
+// Called first thing by ResetHandler, from flash: nothing is in RAM yet and
+// the clocks are as reset left them. Anything this uses has to be inlined
+// or in .launch as well. Only the way into DFU mode copies .dtext to RAM.
+// True to have ResetHandler bring up the clocks and call boot_launch().
+// An image nobody has run the CRC over yet goes the long way, main() checks
+// it from RAM.
+__attribute__ ((section(".launch"), optimize("-Os")))
+bool boot_fast_path(void)
+{
+    if (test_app_missing() || test_boot_token() || !app_image_cached())
     {
-        led_set();
-    }
-    i++;
+        BOOT_PROFILE_MARK(bpFAST_PATH);
+        return false;
     }
-			
 
-    if (test_app_missing() || test_boot_token() || test_boot_pin_low()) {
+    // The boot pin by hand, pinMode() and digitalRead() aren't in RAM yet
+    SIM_SCGC5 |= SIM_SCGC5_PORTB;
+    BOOT_PIN_REG(BOOT_PIN, CONFIG) = PORT_PCR_MUX(1) | PORT_PCR_PE | PORT_PCR_PS;
+
+    uint32_t start = ARM_DWT_CYCCNT;
+    while (ARM_DWT_CYCCNT - start < BOOT_PIN_SETTLE_US * RESET_CYCLES_PER_US) ;
+
+    bool pin_low = (BOOT_PIN_REG(BOOT_PIN, PINREG) & BOOT_PIN_REG(BOOT_PIN, BITMASK)) == 0;
+
+    // Back the way reset had it, for the application
+    BOOT_PIN_REG(BOOT_PIN, CONFIG) = 0;
+    SIM_SCGC5 &= ~SIM_SCGC5_PORTB;
+    BOOT_PROFILE_MARK(bpFAST_PATH);
+
+    if (pin_low) return false;
+
+#if !BOOT_LAUNCH_CLOCKS
+    boot_launch();
+#endif
+    return true;
+}
+#else
+// Still called from flash before .dtext is copied, so it can't be in RAM
+__attribute__ ((section(".launch")))
+bool boot_fast_path(void)
+{
+    return false;
+}
+#endif
+
+int main()
+{	
+    BOOT_PROFILE_MARK(bpMAIN);
+    timebase_init();
+
+    bool dfu_mode = test_app_missing() || test_boot_token() || test_boot_pin_low() || !app_image_check();
+    BOOT_PROFILE_MARK(bpDECIDED);
+
+    if (dfu_mode) {
 
         // Oh boy we're doing DFU mode!
-        uint32_t i = 0;
-		uint32_t j = 0;
+		uint32_t start;
 		uint8_t dfu_returned_state = 1;
 
         led_init();
         dfu_init();
+
+        // Deep sleep is VLPS, for while the host has the bus suspended.
+        // PMPROT only takes one write per reset, the application never
+        // sees it because leaving DFU mode is a reboot.
+        SMC_PMPROT = SMC_PMPROT_AVLP;
+        SMC_PMCTRL = SMC_PMCTRL_STOPM(2);
+
         usb_init();
 
-        // Now we're ready for DFU download
+        // Now we're ready for DFU download. USB and the flash controller are
+        // entirely interrupt driven, we only wake up to update the LED.
         while (dfu_returned_state != dfuMANIFEST)
 		{
 			dfu_returned_state = dfu_getstate();
 			
-			// LED helps us see what's happening, stays on during download, blinks otherwise
-            if ((i % 10000) == 0)
-			{
-				if(!(dfu_returned_state == dfuDNBUSY || dfu_returned_state == dfuDNLOAD_SYNC || dfu_returned_state == dfuDNLOAD_IDLE))
-				{
-					led_clear();
-				}
-            }
-            if ((i % 1000000) == 0)
+			// LED helps us see what's happening, stays on during download, blinks otherwise.
+			// The start of frame interrupt, or SysTick without USB, wakes us once per millisecond.
+            if ((timebase_ms() % 1000) < 100)
 			{
 				led_set();
 			}
+			else if(!(dfu_returned_state == dfuDNBUSY || dfu_returned_state == dfuDNLOAD_SYNC || dfu_returned_state == dfuDNLOAD_IDLE))
+			{
+				led_clear();
+			}
 			
-			// Poll the state machine hella fast or otherwise download will lock up
-			// I think it needs to run faster than the USB S.O.F. by some margin
-            for (j = 10000; j; --j) 
+			// Suspended, and nothing left for the flash to do: sleep in VLPS until
+			// the host resumes. SysTick and the timebase stand still meanwhile.
+			// Resuming clears SLEEPDEEP, also when that happens before the WFI.
+			if (usb_suspended && dfu_flash_idle())
 			{
-				i++;
-				flash_state_machine();
-            }
+				led_clear();
+				SCB_SCR |= SCB_SCR_SLEEPDEEP;
+				if (!usb_suspended)
+				{
+					SCB_SCR &= ~SCB_SCR_SLEEPDEEP;
+				}
+			}
+			
+			__WFI();
         }
 		
-		// Ack DFU download (ideally we should test to see if valid IVF is in memory and fail if not)
+		// The status reply that said dfuMANIFEST is only queued so far. Flash is
+		// done by now, dfuMANIFEST_SYNC waited for it, so once the host has the
+		// reply there's nothing left to wait for.
+		start = timebase_ms();
+		while (!usb_ep0_idle() && timebase_ms() - start < MANIFEST_LINGER_MS)
+		{
+			__WFI();
+		}
+		
+		// Ack DFU download. The next boot checks the image, see app_image.h.
 		dfu_set_idle();
 		
         // Clear boot token, to enter the new application
         boot_token = 0;
 
         // USB disconnect and reboot
-        __disable_irq();
+        NVIC_DISABLE_IRQ(IRQ_USBOTG);
         USB0_CONTROL = 0;
 
-		// Wait a few seconds because the flash won't stabilize otherwise.
-		// /despite/ the CCIF register saying it's all dandy. WHAT THE ACTUAL FUCK.
         // Flash the LED super quickly to let user know DFU download is complete.
-        for (i = 100; i; --i)
+		for (start = timebase_us(); timebase_us() - start < DETACH_MS * 1000; )
 		{
-            led_toggle();
-            for (j = 1000000; j; --j)
-			{
-				__asm__ volatile ("nop");;
-            }
-        }
+			led_toggle();
+			timebase_delay_ms(1);
+		}
+		
+        __disable_irq();
 		
 		// Force reboot by invalid write to WDOG_REFRESH
 		// Any invalid write to the WDOG registers will trigger an immediate reboot
@@ -23,9 +23,12 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "mk20dx128.h"
 #include "usb_dev.h"
 #include "dfu.h"
+#include "memory.h"
+#include "app_image.h"
 
 
 // Internal flash-programming state machine
@@ -35,32 +38,117 @@ static uint16_t g_fl_block_longword_offset = 0;
 static enum 
 {
     flsIDLE = 0,
+	flsBLANKCHECK,
     flsBLOCKBEGIN,
+    flsPROGRAMSECTION,
     flsPROGRAMMING,
 	flsCLEARCACHE,
 	flsVERIFY,
+	flsMARGINCHECK,
+	flsPREERASE,
 } flash_state;
 
+// What a sector needs, compared to what is already in flash
+typedef enum
+{
+	flpUNCHANGED = 0,	// Identical, nothing to do
+	flpBLANK,			// Flash is erased, just program it
+	flpLONGWORDS,		// Only erased long words change, program those without an erase
+	flpERASE,			// Erase and program the whole sector
+} flash_plan_t;
+
+// What we know about each application sector, two bits per sector
+typedef enum
+{
+	fssUNKNOWN = 0,		// Not looked at yet, could hold anything
+	fssERASED,			// Known erased, can be programmed straight away
+	fssPARTIAL,			// Some blocks of this download are in it
+	fssWRITTEN,			// Every block of this download is in it
+} flash_sector_state_t;
+
+static void flash_end_sector();
+
 // DFU state machine
 static dfu_state_t g_dfu_state = dfuIDLE;
 static dfu_status_t g_dfu_status = OK;
 static uint16_t g_dfu_poll_timeout = 1;
 
-// Programming data buffer 
-static uint8_t dfu_download_buffer[DFU_TRANSFER_SIZE];
+// DFU blocks are collected into a ring of sector buffers. USB fills the head
+// slot, a packet at a time straight from the receive buffers, while the flash
+// state machine erases, programs and verifies the tail.
+static uint8_t dfu_sector_ring[DFU_SECTOR_RING_DEPTH][FLASH_SECTOR_SIZE] __attribute__ ((aligned (4)));
+static uint32_t g_fl_ring_addr[DFU_SECTOR_RING_DEPTH];
+static volatile uint8_t g_fl_ring_head = 0;		// Slot being filled by USB
+static volatile uint8_t g_fl_ring_tail = 0;		// Oldest slot waiting for / in flash
+static volatile uint8_t g_fl_ring_queued = 0;	// Complete slots, including the one in flash
+static volatile bool g_fl_head_open = false;	// Head slot holds a partial sector
+static uint32_t g_fl_ring_blocks[DFU_SECTOR_RING_DEPTH];	// DFU blocks received in full per slot, one bit each
+
+// Erased-sector map, so revisited, retried or sparse sectors never get erased
+// for nothing and blocks already programmed into a sector aren't lost.
+static uint8_t g_fl_sector_map[(FLASH_APP_SECTORS * 2 + 7) / 8];
+
+// Set until the first block of a download after reset, DFU_ABORT or
+// SET_INTERFACE. DFU_CLRSTATUS leaves it alone, a block retried after an
+// error belongs to the same download and keeps the map.
+static bool g_fl_new_download = true;
+
+// Full replace (alternate setting 1) erases the application ahead of the
+// download, from its first block on. Selecting the setting erases nothing,
+// so a DFU_UPLOAD on it still reads the application back. Next address to
+// erase, 0 when there is nothing left to do.
+static uint8_t g_dfu_alternate = DFU_ALT_DIFFERENTIAL;
+static uint32_t g_fl_preerase_address = 0;
 
+#if APP_IMAGE_CHECK
+// DFU_UPLOAD block in progress, and the flash address of the trailer's
+// verified word in it, 0 for none
+static const uint8_t *g_upload_data = NULL;
+static uint32_t g_upload_address = 0;
+static uint32_t g_upload_verified = 0;
+#endif
 
-static void *memcpy(void *dst, const void *src, size_t cnt) 
+#if DFU_STREAM
+// Image data from the vendor stream interface goes straight into the sector
+// ring, no DFU blocks. Bytes are counted from the address the stream began at.
+static bool g_stream_open = false;				// Taking data
+static bool g_stream_used = false;				// Something to report on
+static uint32_t g_stream_start = 0;
+static uint32_t g_stream_address = 0;			// Where the next byte goes
+static uint32_t g_stream_programmed = 0;		// Bytes through the flash state machine
+#endif
+
+// Sector currently owned by the flash state machine
+static const uint8_t *g_fl_sector_data = NULL;
+
+// Section program buffer, only valid while FlexRAM is configured as RAM.
+// Volatile, the CPU never reads it back and the stores would be optimized away.
+static volatile uint32_t flexram_section_buffer[FLASH_SECTION_SIZE / 4] __attribute__ ((section(".flexram")));
+static bool g_fl_flexram_ready = false;
+static uint16_t g_fl_section_offset = 0;		// Sector offset of the last section command
+static bool g_fl_section_launched = false;
+
+// How long FTFL commands take on this part, measured with the DWT cycle
+// counter, so DFU_GETSTATUS can tell the host when the flash will be done.
+// Starts out from the typical figures in the datasheet.
+typedef enum
 {
-    uint8_t *dst8 = dst;
-    const uint8_t *src8 = src;
-    while (cnt > 0)
-	{
-        cnt--;
-        *(dst8++) = *(src8++);
-    }
-    return dst;
-}
+	fltERASE_SECTOR = 0,
+	fltPROGRAM_LONG_WORD,
+	fltPROGRAM_SECTION,		// Per long word
+	fltCHECK,				// Read 1s Section or Program Check
+	fltSECTOR,				// What a sector takes on top of programming: erase, checks, verify
+	fltCOUNT
+} flash_timing_t;
+
+static uint32_t g_fl_time_us[fltCOUNT] = { 14000, 65, 18, 45, 14000 };
+static uint32_t g_fl_command_start = 0;			// DWT cycles
+static uint32_t g_fl_command_expected_us = 0;
+static uint8_t g_fl_command_timing = fltCOUNT;	// fltCOUNT when not timing a command
+static uint16_t g_fl_command_longwords = 0;
+static uint32_t g_fl_sector_start = 0;
+static uint16_t g_fl_sector_longwords = 0;		// To program in the current sector
+
 
 static bool ftfl_busy()
 {
@@ -74,14 +162,77 @@ static void ftfl_busy_wait()
     while (ftfl_busy());
 }
 
+static uint32_t ftfl_elapsed_us(uint32_t start)
+{
+	return (ARM_DWT_CYCCNT - start) / (F_CPU / 1000000);
+}
+
+static void ftfl_record_time(flash_timing_t timing, uint32_t us)
+{
+	// Running average, a quarter of the way towards each new measurement
+	g_fl_time_us[timing] = (uint32_t)((int32_t)g_fl_time_us[timing] + ((int32_t)us - (int32_t)g_fl_time_us[timing]) / 4);
+}
+
+static uint32_t ftfl_longword_us()
+{
+	return g_fl_time_us[g_fl_flexram_ready ? fltPROGRAM_SECTION : fltPROGRAM_LONG_WORD];
+}
+
+static void ftfl_command_done()
+{
+	// Fold the time of the command launched last into its estimate, once
+	if (g_fl_command_timing == fltCOUNT || ftfl_busy())
+	{
+		return;
+	}
+	
+	uint32_t us = ftfl_elapsed_us(g_fl_command_start);
+	
+	if (g_fl_command_timing != fltPROGRAM_SECTION)
+	{
+		ftfl_record_time(g_fl_command_timing, us);
+	}
+	else if (g_fl_command_longwords >= FLASH_SECTION_SIZE / 8)
+	{
+		// Short runs would mostly measure the command overhead
+		ftfl_record_time(fltPROGRAM_SECTION, us / g_fl_command_longwords);
+	}
+	g_fl_command_timing = fltCOUNT;
+}
+
 static void ftfl_launch_command()
 {
     // Begin a flash memory controller command
+	ftfl_command_done();
+	g_fl_command_start = ARM_DWT_CYCCNT;
+	g_fl_command_longwords = (FTFL_FCCOB4 << 8) | FTFL_FCCOB5;
+	
+	switch (FTFL_FCCOB0)
+	{
+		case FTFL_CMD_ERASE_FLASH_SECTOR:	g_fl_command_timing = fltERASE_SECTOR; break;
+		case FTFL_CMD_PROGRAM_LONG_WORD:	g_fl_command_timing = fltPROGRAM_LONG_WORD; break;
+		case FTFL_CMD_PROGRAM_SECTOR:		g_fl_command_timing = g_fl_command_longwords ? fltPROGRAM_SECTION : fltCOUNT; break;
+		case FTFL_CMD_READ_1S_SECTION:
+		case FTFL_CMD_PROGRAM_CHECK:		g_fl_command_timing = fltCHECK; break;
+		default:							g_fl_command_timing = fltCOUNT; break;
+	}
+	
+	g_fl_command_expected_us = 0;
+	if (g_fl_command_timing != fltCOUNT)
+	{
+		g_fl_command_expected_us = g_fl_time_us[g_fl_command_timing];
+		if (g_fl_command_timing == fltPROGRAM_SECTION)
+		{
+			g_fl_command_expected_us *= g_fl_command_longwords;
+		}
+	}
 	
 	// Clear error flags
     FTFL_FSTAT = FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL | FTFL_FSTAT_RDCOLERR;
 	// Launch command
     FTFL_FSTAT = FTFL_FSTAT_CCIF;
+	// Let flash_cmd_isr() know when it's done
+	FTFL_FCNFG |= FTFL_FCNFG_CCIE;
 }
 
 static void ftfl_begin_erase_sector(uint32_t sector_address)
@@ -121,14 +272,538 @@ static bool ftfl_begin_program_long_word(uint32_t write_address, uint8_t flash_d
 	}
 }
 
+static bool ftfl_begin_program_section(uint32_t write_address, uint16_t longword_count)
+{
+	if((write_address < APP_ORIGIN) || write_address >= (256 * 1024))
+	{			
+		return true;
+	}
+	else
+	{
+		FTFL_FCCOB0 = FTFL_CMD_PROGRAM_SECTOR;
+		
+		FTFL_FCCOB1 = (unsigned char)((write_address) >> 16) & 0xFF;
+		FTFL_FCCOB2 = (unsigned char)((write_address) >> 8) & 0xFF;
+		FTFL_FCCOB3 = (unsigned char)(write_address) & 0xFF;
+		
+		FTFL_FCCOB4 = (unsigned char)(longword_count >> 8);	// Number of long words to program
+		FTFL_FCCOB5 = (unsigned char)(longword_count);
+		ftfl_launch_command();
+		return false;
+	}
+}
+
+static bool ftfl_begin_read_1s_section(uint32_t read_address, uint16_t longword_count, uint8_t margin)
+{
+	// Blank check. MGSTAT0 is set when done if anything in the range isn't erased.
+	if((read_address < APP_ORIGIN) || read_address >= (256 * 1024))
+	{
+		return true;
+	}
+	else
+	{
+		FTFL_FCCOB0 = FTFL_CMD_READ_1S_SECTION;
+
+		FTFL_FCCOB1 = (unsigned char)((read_address) >> 16) & 0xFF;
+		FTFL_FCCOB2 = (unsigned char)((read_address) >> 8) & 0xFF;
+		FTFL_FCCOB3 = (unsigned char)(read_address) & 0xFF;
+
+		FTFL_FCCOB4 = (unsigned char)(longword_count >> 8);	// Number of long words to check
+		FTFL_FCCOB5 = (unsigned char)(longword_count);
+		FTFL_FCCOB6 = margin;
+		ftfl_launch_command();
+		return false;
+	}
+}
+
+static bool ftfl_begin_program_check(uint32_t read_address, uint8_t margin, uint8_t flash_data_0, uint8_t flash_data_1, uint8_t flash_data_2, uint8_t flash_data_3)
+{
+	// Read a long word back at a margin level. MGSTAT0 is set if it doesn't match.
+	if((read_address < APP_ORIGIN) || read_address >= (256 * 1024))
+	{
+		return true;
+	}
+	else
+	{
+		FTFL_FCCOB0 = FTFL_CMD_PROGRAM_CHECK;
+
+		FTFL_FCCOB1 = (unsigned char)((read_address) >> 16) & 0xFF;
+		FTFL_FCCOB2 = (unsigned char)((read_address) >> 8) & 0xFF;
+		FTFL_FCCOB3 = (unsigned char)(read_address) & 0xFF;
+
+		FTFL_FCCOB4 = margin;
+		FTFL_FCCOB8 = (unsigned char)(flash_data_0); // Expected byte at address + 3 (MSB of longword)
+		FTFL_FCCOB9 = (unsigned char)(flash_data_1);
+		FTFL_FCCOBA = (unsigned char)(flash_data_2);
+		FTFL_FCCOBB = (unsigned char)(flash_data_3); // Expected byte at address (LSB of longword)
+		ftfl_launch_command();
+		return false;
+	}
+}
+
+static bool ftfl_set_flexram_ram()
+{
+	// Turn FlexRAM into plain RAM so it can serve as the section program buffer.
+	// If the FlexNVM configuration doesn't allow it we stay on long word programming.
+	ftfl_busy_wait();
+	FTFL_FCCOB0 = FTFL_CMD_SET_FLEXRAM;
+	FTFL_FCCOB1 = FTFL_CMD_SET_FLEXRAM_RAM;
+	ftfl_launch_command();
+	ftfl_busy_wait();
+	
+	if (FTFL_FSTAT & (FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL))
+	{
+		return false;
+	}
+	return (FTFL_FCNFG & FTFL_FCNFG_RAMRDY) == FTFL_FCNFG_RAMRDY;
+}
+
 static uint32_t flash_address_from_wBlockNum(uint16_t wBlockNum)
 {
     return APP_ORIGIN + (DFU_TRANSFER_SIZE * wBlockNum);
 }
 
+static uint32_t flash_sector_from_address(uint32_t address)
+{
+	return address & ~(FLASH_SECTOR_SIZE - 1);
+}
+
+static flash_sector_state_t flash_get_sector_state(uint32_t sector_address)
+{
+	uint32_t sector = (sector_address - APP_ORIGIN) / FLASH_SECTOR_SIZE;
+
+	if (sector_address < APP_ORIGIN || sector >= FLASH_APP_SECTORS)
+	{
+		return fssUNKNOWN;
+	}
+	return (g_fl_sector_map[sector / 4] >> ((sector % 4) * 2)) & 0x03;
+}
+
+static void flash_set_sector_state(uint32_t sector_address, flash_sector_state_t state)
+{
+	uint32_t sector = (sector_address - APP_ORIGIN) / FLASH_SECTOR_SIZE;
+
+	if (sector_address < APP_ORIGIN || sector >= FLASH_APP_SECTORS)
+	{
+		return;
+	}
+	g_fl_sector_map[sector / 4] &= ~(0x03 << ((sector % 4) * 2));
+	g_fl_sector_map[sector / 4] |= state << ((sector % 4) * 2);
+}
+
+static void flash_begin_download()
+{
+	if (!g_fl_new_download)
+	{
+		// Picking up again after DFU_CLRSTATUS
+		return;
+	}
+	g_fl_new_download = false;
+	
+	// A new image starts. Sectors we know are erased stay that way, but what
+	// the last download put in flash is nothing this one should keep.
+	for (uint32_t sector = 0; sector < FLASH_APP_SECTORS; sector++)
+	{
+		uint32_t sector_address = APP_ORIGIN + sector * FLASH_SECTOR_SIZE;
+
+		if (flash_get_sector_state(sector_address) != fssERASED)
+		{
+			flash_set_sector_state(sector_address, fssUNKNOWN);
+		}
+	}
+	
+	// A full replace erases the rest of the application while the data comes in
+	if (g_dfu_alternate == DFU_ALT_FULL_REPLACE)
+	{
+		g_fl_preerase_address = APP_ORIGIN;
+	}
+}
+
+static void flash_fail(dfu_status_t status)
+{
+	// Give up on the sector in flash, it may now hold anything
+	g_dfu_state = dfuERROR;
+	g_dfu_status = status;
+	flash_state = flsIDLE;
+	flash_set_sector_state(g_fl_block_base_addr, fssUNKNOWN);
+}
+
+static void flash_close_head()
+{
+	// Hand the head slot over to the flash state machine
+	if (g_fl_head_open)
+	{
+		g_fl_head_open = false;
+		g_fl_ring_head = (g_fl_ring_head + 1) % DFU_SECTOR_RING_DEPTH;
+		g_fl_ring_queued++;
+	}
+}
+
+static bool flash_stage_busy(uint32_t address)
+{
+	// Staging at this address needs a new slot and every one is taken, the
+	// open head counts once the host moves on to another sector
+	if (g_fl_head_open && flash_sector_from_address(address) == g_fl_ring_addr[g_fl_ring_head])
+	{
+		return false;
+	}
+	return g_fl_ring_queued + g_fl_head_open >= DFU_SECTOR_RING_DEPTH;
+}
+
+static bool flash_stage_block(uint32_t address, const uint8_t *data, uint16_t length, bool block_end)
+{
+	/*
+	 * Copy a DFU_DNLOAD or stream packet into the sector ring.
+	 * Bytes the host never sends stay erased, unless an earlier visit to the
+	 * sector already put them in flash (see flash_merge_sector()).
+	 * block_end is set on the last packet of a short DFU_DNLOAD block.
+	 *
+	 * Returns false if the packet needs a new slot and none is free.
+	 */
+	
+	uint32_t sector_address = flash_sector_from_address(address);
+	uint32_t offset = address - sector_address;
+	
+	if (g_fl_head_open && sector_address != g_fl_ring_addr[g_fl_ring_head])
+	{
+		// Host moved on to another sector before filling this one
+		flash_close_head();
+	}
+	
+	if (!g_fl_head_open)
+	{
+		if (g_fl_ring_queued >= DFU_SECTOR_RING_DEPTH)
+		{
+			return false;
+		}
+		
+		memset(dfu_sector_ring[g_fl_ring_head], 0xFF, FLASH_SECTOR_SIZE);
+		g_fl_ring_addr[g_fl_ring_head] = sector_address;
+		g_fl_ring_blocks[g_fl_ring_head] = 0;
+		g_fl_head_open = true;
+	}
+	
+	memcpy(dfu_sector_ring[g_fl_ring_head] + offset, data, length);
+	
+	// A block counts as received once its last byte is in, so the tail of a
+	// stream that stops partway through a sector leaves it fssPARTIAL
+	for (uint32_t block = offset / DFU_TRANSFER_SIZE; block < (offset + length) / DFU_TRANSFER_SIZE; block++)
+	{
+		g_fl_ring_blocks[g_fl_ring_head] |= 1UL << block;
+	}
+	if (block_end)
+	{
+		g_fl_ring_blocks[g_fl_ring_head] |= 1UL << (offset / DFU_TRANSFER_SIZE);
+	}
+	
+	// Program as soon as the packet completes a sector
+	if (((address + length) % FLASH_SECTOR_SIZE) == 0)
+	{
+		flash_close_head();
+	}
+	return true;
+}
+
+static void flash_reset_staging()
+{
+	// Forget any queued or partially collected sectors, e.g. after an error or
+	// abort. A sector that is already in flash runs to completion.
+	g_fl_head_open = false;
+#if DFU_STREAM
+	g_stream_open = false;
+#endif
+	g_fl_ring_queued = (flash_state == flsIDLE || flash_state == flsPREERASE) ? 0 : 1;
+	g_fl_ring_head = (g_fl_ring_tail + g_fl_ring_queued) % DFU_SECTOR_RING_DEPTH;
+}
+
+static void flash_kick()
+{
+	// New work for the flash state machine. If no FTFL command is running there
+	// won't be a command complete interrupt, so raise one ourselves.
+	NVIC_SET_PENDING(IRQ_FTFL_COMPLETE);
+}
+
+static void flash_invalidate_cache()
+{
+	// Drop anything the flash controller cached or prefetched, so reads see
+	// what is actually in the array after an erase or program.
+	FMC_PFB0CR |= FMC_PFB0CR_CINV_WAY_ALL | FMC_PFB0CR_S_B_INV;
+}
+
+static flash_plan_t flash_plan_sector(uint32_t sector_address, const uint8_t *data)
+{
+	/*
+	 * Compare a new sector with what is already in flash and work out the
+	 * cheapest way to get there.
+	 *
+	 * The FTFL doesn't allow programming a long word twice without an erase in
+	 * between, not even to clear more bits. So a sector can only skip the erase
+	 * if every long word that changes is still erased in flash.
+	 */
+
+	const uint32_t *flash_words = FLASH_PTR(sector_address);
+	const uint32_t *new_words = (const uint32_t *)data;
+	uint16_t changed_words = 0;
+	bool blank = true;
+	
+	flash_invalidate_cache();
+	
+	for (int i = 0; i < FLASH_SECTOR_SIZE / 4; i++)
+	{
+		if (flash_words[i] != 0xFFFFFFFF)
+		{
+			blank = false;
+		}
+		
+		if (flash_words[i] != new_words[i])
+		{
+			if (flash_words[i] != 0xFFFFFFFF)
+			{
+				// Needs a 0 turned back into a 1
+				return flpERASE;
+			}
+			changed_words++;
+		}
+	}
+	
+	if (changed_words == 0)
+	{
+		return flpUNCHANGED;
+	}
+	else if (blank)
+	{
+		return flpBLANK;
+	}
+	else if (changed_words <= DFU_DIFF_MAX_LONGWORDS)
+	{
+		return flpLONGWORDS;
+	}
+	else
+	{
+		// So many words change that erasing and section programming is quicker
+		return flpERASE;
+	}
+}
+
+static uint16_t flash_next_run()
+{
+	/*
+	 * Find the next run of long words to section program, starting at
+	 * g_fl_block_longword_offset. Erased flash already reads 0xFFFFFFFF, so
+	 * all-ones words are never programmed: the offset skips past them and a run
+	 * ends where DFU_BLANK_RUN_MIN of them in a row make a second command
+	 * cheaper than programming through them. Verify still checks they read blank.
+	 *
+	 * Returns the run length in long words, 0 when the sector is done.
+	 */
+	
+	const uint32_t *words = (const uint32_t *)g_fl_sector_data;
+	uint16_t first = g_fl_block_longword_offset / 4;
+	uint16_t last;
+	uint16_t blank = 0;
+	
+	while (first < FLASH_SECTOR_SIZE / 4 && words[first] == 0xFFFFFFFF)
+	{
+		first++;
+	}
+	g_fl_block_longword_offset = first * 4;
+	
+	for (last = first; last < FLASH_SECTOR_SIZE / 4 && (last - first) < FLASH_SECTION_SIZE / 4; last++)
+	{
+		if (words[last] != 0xFFFFFFFF)
+		{
+			blank = 0;
+		}
+		else if (++blank == DFU_BLANK_RUN_MIN)
+		{
+			last++;
+			break;
+		}
+	}
+	
+	// Trailing all-ones words of the run are left out too
+	while (last > first && words[last - 1] == 0xFFFFFFFF)
+	{
+		last--;
+	}
+	return last - first;
+}
+
+static bool flash_begin_margin_check()
+{
+	/*
+	 * Launch the margin check for the next part of the sector at
+	 * g_fl_block_longword_offset. A run of all-ones long words takes a single
+	 * Read 1s Section command, anything else a Program Check per long word.
+	 *
+	 * Returns true if the address is out of bounds.
+	 */
+	
+	const uint32_t *words = (const uint32_t *)g_fl_sector_data;
+	uint16_t first = g_fl_block_longword_offset / 4;
+	uint16_t last = first;
+	uint32_t check_address = g_fl_block_base_addr + g_fl_block_longword_offset;
+	
+	while (last < FLASH_SECTOR_SIZE / 4 && words[last] == 0xFFFFFFFF)
+	{
+		last++;
+	}
+	
+	if (last > first)
+	{
+		g_fl_block_longword_offset = last * 4;
+		return ftfl_begin_read_1s_section(check_address, last - first, DFU_VERIFY_LEVEL);
+	}
+	
+	g_fl_block_longword_offset += 4;
+	return ftfl_begin_program_check(check_address, DFU_VERIFY_LEVEL,
+		g_fl_sector_data[first * 4 + 0x03], g_fl_sector_data[first * 4 + 0x02],
+		g_fl_sector_data[first * 4 + 0x01], g_fl_sector_data[first * 4 + 0x00]);
+}
+
+static void flash_preerase_step()
+{
+	/*
+	 * Erase the next sector of the application for a full replace. Sectors
+	 * already erased or already holding new data are left alone.
+	 *
+	 * Program flash is a single block on this part, the bootloader included,
+	 * and FPROT leaves it unprotected. Erase Flash Block would take the
+	 * bootloader with it, so this goes sector by sector.
+	 */
+	
+	uint32_t address = g_fl_preerase_address;
+	
+	while (address <= P_FLASH_END && flash_get_sector_state(address) != fssUNKNOWN)
+	{
+		address += FLASH_SECTOR_SIZE;
+	}
+	
+	if (address > P_FLASH_END)
+	{
+		g_fl_preerase_address = 0;
+		return;
+	}
+	
+	g_fl_preerase_address = address;
+	g_fl_block_base_addr = address;
+	flash_state = flsPREERASE;
+	ftfl_begin_erase_sector(address);
+}
+
+static uint16_t flash_count_longwords(const uint8_t *data, uint16_t first)
+{
+	// Long words from first on that need programming, all-ones ones never do
+	const uint32_t *words = (const uint32_t *)data;
+	uint16_t count = 0;
+	
+	for (; first < FLASH_SECTOR_SIZE / 4; first++)
+	{
+		count += words[first] != 0xFFFFFFFF;
+	}
+	return count;
+}
+
+static void flash_merge_sector(uint32_t sector_address, uint8_t slot)
+{
+	// Earlier blocks of this download are already in flash. Copy them into the
+	// slot, so the sector is compared and, if need be, rewritten as a whole.
+	const uint8_t *flash_data = FLASH_PTR(sector_address);
+	uint8_t *data = dfu_sector_ring[slot];
+	
+	flash_invalidate_cache();
+	
+	for (int block = 0; block < DFU_BLOCKS_PER_SECTOR; block++)
+	{
+		if (!(g_fl_ring_blocks[slot] & (1UL << block)))
+		{
+			memcpy(data + block * DFU_TRANSFER_SIZE, flash_data + block * DFU_TRANSFER_SIZE, DFU_TRANSFER_SIZE);
+		}
+	}
+}
+
+static void flash_begin_sector()
+{
+	// Start on the oldest queued sector, flash_state_machine() takes it from here
+	flash_sector_state_t sector_state;
+	flash_plan_t plan;
+	
+	g_fl_block_base_addr = g_fl_ring_addr[g_fl_ring_tail];
+	g_fl_sector_data = dfu_sector_ring[g_fl_ring_tail];
+	g_fl_block_longword_offset = 0;
+	g_fl_sector_start = ARM_DWT_CYCCNT;
+	
+	sector_state = flash_get_sector_state(g_fl_block_base_addr);
+	if (sector_state == fssPARTIAL || sector_state == fssWRITTEN)
+	{
+		// Revisited by an out of order or retried block
+		flash_merge_sector(g_fl_block_base_addr, g_fl_ring_tail);
+	}
+	
+	g_fl_sector_longwords = flash_count_longwords(g_fl_sector_data, 0);
+	
+#if DFU_DIFFERENTIAL
+	plan = flash_plan_sector(g_fl_block_base_addr, g_fl_sector_data);
+#else
+	// Let the blank check decide about the erase
+	plan = flpBLANK;
+#endif
+
+	switch (plan)
+	{
+		case flpUNCHANGED:
+			// Already there, no FTFL commands at all
+			flash_end_sector();
+			return;
+			
+		case flpBLANK:
+			if (sector_state == fssERASED)
+			{
+				// Nothing to erase
+				flash_state = g_fl_flexram_ready ? flsPROGRAMSECTION : flsPROGRAMMING;
+				return;
+			}
+			
+			// Reads as erased, make sure it really is before skipping the erase
+			flash_state = flsBLANKCHECK;
+			if (ftfl_begin_read_1s_section(g_fl_block_base_addr, FLASH_SECTOR_SIZE / 4, DFU_BLANK_CHECK_MARGIN))
+			{
+				// Outside the application, erase would refuse it too
+				flash_state = flsBLOCKBEGIN;
+			}
+			return;
+			
+		case flpLONGWORDS:
+			// Program just the long words that changed
+			flash_state = flsPROGRAMMING;
+			return;
+			
+		case flpERASE:
+			break;
+	}
+
+	flash_state = flsBLOCKBEGIN;
+	ftfl_begin_erase_sector(g_fl_block_base_addr);
+}
+
 void dfu_init()
 {
 	flash_state = flsIDLE;
+	g_fl_ring_tail = 0;
+	flash_reset_staging();
+	g_fl_flexram_ready = ftfl_set_flexram_ram();
+	
+	// Cycle counter for the command timings
+	ARM_DEMCR |= ARM_DEMCR_TRCENA;
+	ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+	g_fl_command_timing = fltCOUNT;
+	
+	// The flash state machine runs from the command complete interrupt. It has
+	// the same priority as the USB interrupt, so neither ever preempts the other
+	// and they can share the sector ring without locking.
+	FTFL_FCNFG &= ~FTFL_FCNFG_CCIE;
+	NVIC_CLEAR_PENDING(IRQ_FTFL_COMPLETE);
+	NVIC_ENABLE_IRQ(IRQ_FTFL_COMPLETE);
 }
 
 uint8_t dfu_getstate()
@@ -136,6 +811,18 @@ uint8_t dfu_getstate()
     return g_dfu_state;
 }
 
+bool dfu_flash_idle()
+{
+	return !g_fl_head_open && !g_fl_ring_queued && flash_state == flsIDLE && !g_fl_preerase_address;
+}
+
+bool dfu_download_busy(unsigned wBlockNum, unsigned packetOffset)
+{
+	// A packet starting a new sector has to wait for a free slot. The host
+	// gets NAKed meanwhile, its data stays in the USB receive buffer.
+	return flash_stage_busy(flash_address_from_wBlockNum(wBlockNum) + packetOffset);
+}
+
 bool dfu_download(unsigned wBlockNum, unsigned wLength, unsigned packetOffset, unsigned packetLength, const uint8_t *data)
 {
     if (packetOffset + packetLength > DFU_TRANSFER_SIZE || packetOffset + packetLength > wLength) 
@@ -146,79 +833,227 @@ bool dfu_download(unsigned wBlockNum, unsigned wLength, unsigned packetOffset, u
         return false;
     }
 
-    // Store more data...
-    memcpy(dfu_download_buffer + packetOffset, data, packetLength);
+	if (wLength && wBlockNum >= FLASH_APP_SECTORS * DFU_BLOCKS_PER_SECTOR)
+	{
+		// Past the end of flash. The zero length block ending a download
+		// may carry any number, it stages nothing.
+		g_dfu_state = dfuERROR;
+		g_dfu_status = errADDRESS;
+		return false;
+	}
 
-    if (packetOffset + packetLength != wLength) 
+#if DFU_STREAM
+	if (g_stream_open)
 	{
-        // Still waiting for more data.
-        return true;
-    }
+		// One download at a time
+		g_dfu_state = dfuERROR;
+		g_dfu_status = errSTALLEDPKT;
+		return false;
+	}
+#endif
 
-    if (g_dfu_state != dfuIDLE && g_dfu_state != dfuDNLOAD_IDLE) 
+    if (packetOffset == 0)
 	{
-        // Wrong state! Oops.
-        g_dfu_state = dfuERROR;
-        g_dfu_status = errSTALLEDPKT;
-        return false;
-    }
+		if (g_dfu_state != dfuIDLE && g_dfu_state != dfuDNLOAD_IDLE) 
+		{
+			// Wrong state! Oops.
+			g_dfu_state = dfuERROR;
+			g_dfu_status = errSTALLEDPKT;
+			return false;
+		}
+
+		if (!wLength) 
+		{
+			// End of download, program whatever is left of the last sector
+			flash_close_head();
+			flash_kick();
+			
+			g_dfu_state = dfuMANIFEST_SYNC;
+			g_dfu_status = OK;
+			return true;
+		}
 
-    if (ftfl_busy() || flash_state != flsIDLE) 
+		if (g_dfu_state == dfuIDLE)
+		{
+			// First block of a new download, or of a retry after an error
+			flash_begin_download();
+#if DFU_STREAM
+			g_stream_used = false;
+#endif
+		}
+	}
+	
+	// Store more data, straight into its sector slot
+	if (!flash_stage_block(flash_address_from_wBlockNum(wBlockNum) + packetOffset, data, packetLength,
+		packetOffset + packetLength == wLength))
 	{
-        // Flash controller shouldn't be busy now!
-        g_dfu_state = dfuERROR;
-        g_dfu_status = errUNKNOWN;
-        return false;       
-    }
+		// Didn't check dfu_download_busy() first
+		g_dfu_state = dfuERROR;
+		g_dfu_status = errUNKNOWN;
+		return false;
+	}
 
-    if (!wLength) 
+    if (packetOffset + packetLength != wLength) 
 	{
-        // End of download
-        g_dfu_state = dfuMANIFEST_SYNC;
-        g_dfu_status = OK;
+        // Still waiting for more data.
         return true;
     }
-
-    // Start programming a DFU block in flash
-    flash_state = flsBLOCKBEGIN;
-    g_fl_block_base_addr = flash_address_from_wBlockNum(wBlockNum);
-		
-	// Only erase when address pointer is beginning of a sector
-	if((g_fl_block_base_addr % FLASH_SECTOR_SIZE) == 0)
-	{
-		ftfl_begin_erase_sector(g_fl_block_base_addr);
-	}
 	
+	flash_kick();
     g_dfu_state = dfuDNLOAD_SYNC;
     g_dfu_status = OK;
     return true;
 }
 
-bool dfu_upload(unsigned wBlockNum, uint16_t expected_wLength, const uint8_t * output_buffer, uint32_t * returned_wLength)
+bool dfu_upload(unsigned wBlockNum, uint16_t expected_wLength, const uint8_t ** data, uint32_t * returned_wLength)
 {
-	// Get memory address
-	uint32_t *flash_address = flash_address_from_wBlockNum(wBlockNum);
-
-	// Copy data from flash to output buffer
-	memcpy(output_buffer, flash_address, expected_wLength);
-	
-	if(flash_address > (P_FLASH_END - APP_ORIGIN))
+	if (wBlockNum >= FLASH_APP_SECTORS * DFU_BLOCKS_PER_SECTOR)
 	{
-		// Yes
+		// Past the end of flash, a short block ends the upload
+		*data = NULL;
 		*returned_wLength = 0;
 		g_dfu_state = dfuIDLE;
 		g_dfu_status = OK;
 		return false;
 	}
-	else
+
+	// No copy, the USB code reads flash a packet at a time as it sends
+	uint32_t flash_address = flash_address_from_wBlockNum(wBlockNum);
+	uint32_t length = P_FLASH_END + 1 - flash_address;
+
+	*data = FLASH_PTR(flash_address);
+	*returned_wLength = expected_wLength < length ? expected_wLength : length;
+#if APP_IMAGE_CHECK
+	const app_image_trailer_t *trailer = app_image_trailer();
+	
+	g_upload_data = *data;
+	g_upload_address = flash_address;
+	g_upload_verified = trailer ? APP_ORIGIN + trailer->length + offsetof(app_image_trailer_t, verified) : 0;
+#endif
+	g_dfu_state = dfuUPLOAD_IDLE;
+	g_dfu_status = OK;
+	return true;
+}
+
+void dfu_upload_copy(uint8_t *packet, const uint8_t *data, uint32_t size)
+{
+	memcpy(packet, data, size);
+	
+#if APP_IMAGE_CHECK
+	// The first boot programs verified in the trailer, app_image_check().
+	// It goes out erased, as the seal tool left it, so a read back compares
+	// equal to the binary that was downloaded.
+	uint32_t address = g_upload_address + (data - g_upload_data);
+	
+	for (uint32_t i = 0; g_upload_verified && i < 4; i++)
 	{
-		// No
-		*returned_wLength = expected_wLength;
-		g_dfu_state = dfuUPLOAD_IDLE;
-		g_dfu_status = OK;
-		return true;
+		if (g_upload_verified + i - address < size)
+		{
+			packet[g_upload_verified + i - address] = 0xFF;
+		}
+	}
+#endif
+}
+
+#if DFU_STREAM
+bool dfu_stream_begin(unsigned wBlockNum)
+{
+	// Same starting point as a DFU_DNLOAD with this block number, the
+	// alternate setting applies as well
+	if (g_dfu_state != dfuIDLE)
+	{
+		g_dfu_state = dfuERROR;
+		g_dfu_status = errSTALLEDPKT;
+		return false;
+	}
+	
+	flash_begin_download();
+	g_stream_start = flash_address_from_wBlockNum(wBlockNum);
+	g_stream_address = g_stream_start;
+	g_stream_programmed = 0;
+	g_stream_open = true;
+	g_stream_used = true;
+	g_dfu_state = dfuDNLOAD_IDLE;
+	g_dfu_status = OK;
+	return true;
+}
+
+bool dfu_stream_busy()
+{
+	// A packet starting a new sector has to wait for a free slot. Anything
+	// else is taken, or refused, right away.
+	return g_stream_open && flash_stage_busy(g_stream_address);
+}
+
+bool dfu_stream_write(const uint8_t *data, unsigned length)
+{
+	if (!g_stream_open || g_dfu_state != dfuDNLOAD_IDLE)
+	{
+		// Not streaming, or a flash error ended it
+		if (g_dfu_state != dfuERROR)
+		{
+			g_dfu_state = dfuERROR;
+			g_dfu_status = errSTALLEDPKT;
+		}
+		return false;
+	}
+	
+	if (g_stream_address + length > P_FLASH_END + 1)
+	{
+		g_dfu_state = dfuERROR;
+		g_dfu_status = errADDRESS;
+		return false;
+	}
+	
+	if (!flash_stage_block(g_stream_address, data, length, false))
+	{
+		// Didn't check dfu_stream_busy() first
+		g_dfu_state = dfuERROR;
+		g_dfu_status = errUNKNOWN;
+		return false;
+	}
+	
+	g_stream_address += length;
+	flash_kick();
+	return true;
+}
+
+bool dfu_stream_end()
+{
+	// End of the image, program whatever is left of the last sector. The host
+	// finishes with DFU_GETSTATUS, as after a zero length DFU_DNLOAD.
+	if (!g_stream_open || g_dfu_state != dfuDNLOAD_IDLE)
+	{
+		return false;
+	}
+	
+	g_stream_open = false;
+	flash_close_head();
+	flash_kick();
+	g_dfu_state = dfuMANIFEST_SYNC;
+	g_dfu_status = OK;
+	return true;
+}
+
+bool dfu_stream_status(uint8_t *report)
+{
+	// Nothing to say before the first stream
+	if (!g_stream_used)
+	{
+		return false;
 	}
+	
+	report[0] = g_dfu_status;
+	report[1] = g_dfu_state;
+	report[2] = dfu_flash_idle();
+	report[3] = 0;
+	report[4] = g_stream_programmed;
+	report[5] = g_stream_programmed >> 8;
+	report[6] = g_stream_programmed >> 16;
+	report[7] = g_stream_programmed >> 24;
+	return true;
 }
+#endif
 
 static bool fl_handle_status(uint8_t fstat, uint16_t specific_error)
 {
@@ -239,44 +1074,82 @@ static bool fl_handle_status(uint8_t fstat, uint16_t specific_error)
     if (fstat & FTFL_FSTAT_RDCOLERR) 
 	{
         // Bus collision. We did something wrong internally.
-        g_dfu_state = dfuERROR;
-        g_dfu_status = errUNKNOWN;
-        flash_state = flsIDLE;
+        flash_fail(errUNKNOWN);
         return true;
     }
 
 	if (fstat & FTFL_FSTAT_FPVIOL) 
 	{
 		// Protection error
-		g_dfu_state = dfuERROR;
-		g_dfu_status = errADDRESS;
-		flash_state = flsIDLE;
+		flash_fail(errADDRESS);
 		return true;
 	}
 
     if (fstat & FTFL_FSTAT_ACCERR) 
 	{
         // Write error
-        g_dfu_state = dfuERROR;
-        g_dfu_status = errWRITE;
-        flash_state = flsIDLE;
+        flash_fail(errWRITE);
         return true;
     }
 
     if (fstat & FTFL_FSTAT_MGSTAT0) 
 	{
         // Command-specifid error
-        g_dfu_state = dfuERROR;
-        g_dfu_status = specific_error;
-        flash_state = flsIDLE;
+        flash_fail(specific_error);
         return true;
     }
 
     return false;
 }
 
-// Try to advance our flash programming state machine.
-void flash_state_machine()
+static void flash_end_sector()
+{
+	// Sector is done, free its slot
+	uint32_t us = ftfl_elapsed_us(g_fl_sector_start);
+	uint32_t programming_us = g_fl_sector_longwords * ftfl_longword_us();
+	
+	flash_state = flsIDLE;
+	ftfl_record_time(fltSECTOR, us > programming_us ? us - programming_us : 0);
+	if (g_dfu_state == dfuERROR)
+	{
+		flash_set_sector_state(g_fl_block_base_addr, fssUNKNOWN);
+	}
+	else if (g_fl_ring_blocks[g_fl_ring_tail] == DFU_ALL_BLOCKS)
+	{
+		flash_set_sector_state(g_fl_block_base_addr, fssWRITTEN);
+	}
+	else
+	{
+		flash_set_sector_state(g_fl_block_base_addr, fssPARTIAL);
+	}
+	
+	if (g_fl_ring_queued)
+	{
+		g_fl_ring_tail = (g_fl_ring_tail + 1) % DFU_SECTOR_RING_DEPTH;
+		g_fl_ring_queued--;
+	}
+	
+#if DFU_STREAM
+	if (g_stream_used && g_dfu_state != dfuERROR)
+	{
+		uint32_t sector_end = g_fl_block_base_addr + FLASH_SECTOR_SIZE;
+		g_stream_programmed = (sector_end < g_stream_address ? sector_end : g_stream_address) - g_stream_start;
+	}
+#endif
+	
+	// A slot is free for packets the host is being NAKed on, and there may be
+	// stream news to report. The USB interrupt takes care of both.
+	NVIC_SET_PENDING(IRQ_USBOTG);
+	
+	if (g_dfu_state == dfuERROR)
+	{
+		// Don't carry on past a failed sector
+		flash_reset_staging();
+	}
+}
+
+// Advance our flash programming state machine by one step.
+static void flash_step()
 {
     uint8_t fstat = FTFL_FSTAT;
 	uint32_t flash_address = g_fl_block_base_addr + g_fl_block_longword_offset;
@@ -284,38 +1157,151 @@ void flash_state_machine()
     switch (flash_state) 
 	{
         case flsIDLE:
-			// Nothing to do here
+			if (g_dfu_state == dfuERROR || ftfl_busy())
+			{
+				break;
+			}
+			
+			// Start on the next sector, if USB has finished one. While pre-erasing
+			// that waits until the sector has had its turn.
+			if (g_fl_ring_queued && (!g_fl_preerase_address ||
+				flash_get_sector_state(g_fl_ring_addr[g_fl_ring_tail]) != fssUNKNOWN))
+			{
+				flash_begin_sector();
+			}
+			else if (g_fl_preerase_address)
+			{
+				flash_preerase_step();
+			}
             break;
+			
+		case flsPREERASE:
+			if (!fl_handle_status(fstat, errERASE) && !ftfl_busy())
+			{
+				uint32_t end = g_fl_block_base_addr + FLASH_SECTOR_SIZE;
+				
+				flash_set_sector_state(g_fl_block_base_addr, fssERASED);
+				
+				// Unless the host switched back to alternate setting 0, or a new
+				// download started the erase over, meanwhile
+				if (g_fl_preerase_address == g_fl_block_base_addr)
+				{
+					g_fl_preerase_address = (end > P_FLASH_END) ? 0 : end;
+				}
+				flash_state = flsIDLE;
+			}
+			break;
+
+		case flsBLANKCHECK:
+			if ((fstat & FTFL_FSTAT_CCIF) && !(fstat & (FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL | FTFL_FSTAT_RDCOLERR)))
+			{
+				if (fstat & FTFL_FSTAT_MGSTAT0)
+				{
+					// Not quite erased after all
+					flash_state = flsBLOCKBEGIN;
+					ftfl_begin_erase_sector(g_fl_block_base_addr);
+				}
+				else
+				{
+					flash_set_sector_state(g_fl_block_base_addr, fssERASED);
+					flash_state = g_fl_flexram_ready ? flsPROGRAMSECTION : flsPROGRAMMING;
+				}
+				break;
+			}
+			fl_handle_status(fstat, errCHECK_ERASED);
+			break;
 
         case flsBLOCKBEGIN:
             if (!fl_handle_status(fstat, errERASE) && !ftfl_busy()) 
 			{
+				flash_set_sector_state(g_fl_block_base_addr, fssERASED);
+				
                 // Erasing done, now move on to programming the flash.
-                flash_state = flsPROGRAMMING;
+				// Whole sections through FlexRAM if we can, long words if not.
+                flash_state = g_fl_flexram_ready ? flsPROGRAMSECTION : flsPROGRAMMING;
 				g_fl_block_longword_offset = 0;
             }
             break;
 
+        case flsPROGRAMSECTION:
+			if ((fstat & FTFL_FSTAT_CCIF) && (fstat & FTFL_FSTAT_ACCERR) && g_fl_section_launched)
+			{
+				// FlexRAM wasn't usable after all. Nothing was programmed by the
+				// failed command, so redo this run one long word at a time.
+				g_fl_flexram_ready = false;
+				g_fl_section_launched = false;
+				g_fl_block_longword_offset = g_fl_section_offset;
+				FTFL_FSTAT = FTFL_FSTAT_ACCERR;
+				flash_state = flsPROGRAMMING;
+				break;
+			}
+			
+			if(!fl_handle_status(fstat, errPROG))
+			{
+				if(!ftfl_busy())
+				{
+					uint16_t run_longwords = flash_next_run();
+					
+					if(run_longwords)
+					{
+						// Load the section program buffer, then program the run in one command
+						const uint32_t *src = (const uint32_t *)(g_fl_sector_data + g_fl_block_longword_offset);
+						for (int i = 0; i < run_longwords; i++)
+						{
+							flexram_section_buffer[i] = src[i];
+						}
+						
+						if(ftfl_begin_program_section(g_fl_block_base_addr + g_fl_block_longword_offset, run_longwords))
+						{
+							// Exception occurred, memory address out of bounds
+							flash_fail(errWRITE);
+						}
+						else
+						{
+							g_fl_section_offset = g_fl_block_longword_offset;
+							g_fl_section_launched = true;
+							g_fl_block_longword_offset += run_longwords * 4;
+						}
+					}
+					else
+					{
+						// Programming done, begin verify
+						g_fl_section_launched = false;
+						flash_state = flsCLEARCACHE;
+					}
+				}
+			}
+			break;
+
         case flsPROGRAMMING:
 			// Continue as long as no flash errors
 			if(!fl_handle_status(fstat, errVERIFY))
 			{
 				if(!ftfl_busy())
 				{								
-					// This script may write garbage at the end of the application if the last DFU transfer is < 64 bytes...
-					// Might not be an issue since that flash is never accessed anyway
-					if(g_fl_block_longword_offset < DFU_TRANSFER_SIZE)
+					// Long words that already hold the right value are left alone. After
+					// an erase that's the 0xFFFFFFFF ones, otherwise everything unchanged.
+					const uint32_t *flash_words = FLASH_PTR(g_fl_block_base_addr);
+					const uint32_t *new_words = (const uint32_t *)g_fl_sector_data;
+					
+					while (g_fl_block_longword_offset < FLASH_SECTOR_SIZE &&
+						flash_words[g_fl_block_longword_offset / 4] == new_words[g_fl_block_longword_offset / 4])
+					{
+						g_fl_block_longword_offset += 4;
+					}
+					flash_address = g_fl_block_base_addr + g_fl_block_longword_offset;
+					
+					if(g_fl_block_longword_offset < FLASH_SECTOR_SIZE)
 					{	
-						uint8_t flash_data_0 = dfu_download_buffer[g_fl_block_longword_offset + 0x03];
-						uint8_t flash_data_1 = dfu_download_buffer[g_fl_block_longword_offset + 0x02];
-						uint8_t flash_data_2 = dfu_download_buffer[g_fl_block_longword_offset + 0x01];
-						uint8_t flash_data_3 = dfu_download_buffer[g_fl_block_longword_offset + 0x00];
+						uint8_t flash_data_0 = g_fl_sector_data[g_fl_block_longword_offset + 0x03];
+						uint8_t flash_data_1 = g_fl_sector_data[g_fl_block_longword_offset + 0x02];
+						uint8_t flash_data_2 = g_fl_sector_data[g_fl_block_longword_offset + 0x01];
+						uint8_t flash_data_3 = g_fl_sector_data[g_fl_block_longword_offset + 0x00];
 													
 						if(ftfl_begin_program_long_word(flash_address, flash_data_0, flash_data_1, flash_data_2, flash_data_3))
 						{
 							// Exception occurred, memory address out of bounds
-							g_dfu_state = dfuERROR;
-							g_dfu_status = errWRITE;							
+							flash_fail(errWRITE);
 						}
 						else
 						{
@@ -323,7 +1309,7 @@ void flash_state_machine()
 							g_fl_block_longword_offset += 4;
 						}
 					}
-					else if(g_fl_block_longword_offset >= DFU_TRANSFER_SIZE)
+					else if(g_fl_block_longword_offset >= FLASH_SECTOR_SIZE)
 					{
 						// Programming done, begin verify
 						flash_state = flsCLEARCACHE;
@@ -335,7 +1321,7 @@ void flash_state_machine()
 			
 			case flsCLEARCACHE:
 			{
-				FMC_PFB0CR |= 0b00000011100000000000000000000000;
+				flash_invalidate_cache();
 				flash_state = flsVERIFY;
 			}
 			break;
@@ -344,55 +1330,193 @@ void flash_state_machine()
 			{
 				if(!ftfl_busy())
 				{
-					// Verify the last written block and toss exception if failed
-					uint8_t test_buffer[DFU_TRANSFER_SIZE];
-					memcpy(&test_buffer, g_fl_block_base_addr, DFU_TRANSFER_SIZE);
+					// Verify the sector we just wrote and toss exception if failed
+					if(memcmp(FLASH_PTR(g_fl_block_base_addr), g_fl_sector_data, FLASH_SECTOR_SIZE))
+					{
+						g_dfu_state = dfuERROR;
+						g_dfu_status = errVERIFY;
+					}
 					
-					// I have no idea why, but the first 16 bytes take a long time to stabilize.
-					// I suspect it is a bug in the kinetis FFTL controller.
-					for(int i = 0; i < DFU_TRANSFER_SIZE; i++)
+#if DFU_VERIFY_LEVEL != FTFL_MARGIN_NORMAL
+					if (g_dfu_state != dfuERROR)
 					{
-						if(test_buffer[i] != dfu_download_buffer[i])
-						{
-							g_dfu_state = dfuERROR;
-							g_dfu_status = errVERIFY;
-							flash_state = flsIDLE;
-							break;
-						}
+						// Reads back fine, now make sure it does at the margin too
+						g_fl_block_longword_offset = 0;
+						flash_state = flsMARGINCHECK;
+						break;
 					}
+#endif
 					
-					// If no error, set state to done
-					flash_state = flsIDLE;					
+					// Done with this sector, error or not
+					flash_end_sector();
 					break;
 				}
 			}
 			break;
+			
+			case flsMARGINCHECK:
+				// A failed check sets MGSTAT0, which ends up as errVERIFY
+				if(!fl_handle_status(fstat, errVERIFY) && !ftfl_busy())
+				{
+					if(g_fl_block_longword_offset >= FLASH_SECTOR_SIZE)
+					{
+						flash_end_sector();
+					}
+					else if(flash_begin_margin_check())
+					{
+						// Exception occurred, memory address out of bounds
+						flash_fail(errVERIFY);
+					}
+				}
+				break;
     }
 }
 
+// Run the flash programming state machine until it is waiting on the FTFL
+// or has run out of work.
+void flash_state_machine()
+{
+	for (;;)
+	{
+		uint8_t previous_state = flash_state;
+		uint16_t previous_offset = g_fl_block_longword_offset;
+		uint8_t previous_tail = g_fl_ring_tail;
+		
+		flash_step();
+		
+		if (ftfl_busy() || (flash_state == previous_state && g_fl_block_longword_offset == previous_offset && g_fl_ring_tail == previous_tail))
+		{
+			break;
+		}
+	}
+}
+
+void flash_cmd_isr(void)
+{
+	// Command complete, or a kick from dfu_download(). CCIF stays set while the
+	// FTFL is idle, so only keep the interrupt enabled while a command runs.
+	FTFL_FCNFG &= ~FTFL_FCNFG_CCIE;
+	ftfl_command_done();
+	flash_state_machine();
+	
+	// A kick can come in while a command is still running. Nothing new was
+	// launched then, but the command complete interrupt is still needed.
+	if (ftfl_busy())
+	{
+		FTFL_FCNFG |= FTFL_FCNFG_CCIE;
+	}
+}
+
+static uint32_t flash_remaining_us()
+{
+	/*
+	 * Estimate how long the flash state machine needs for the work it has
+	 * been given: the rest of the command in progress, the rest of the sector,
+	 * the sectors queued behind it and what a full replace still has to erase.
+	 */
+	
+	uint32_t us = 0;
+	uint16_t first = g_fl_block_longword_offset / 4;
+	uint32_t elapsed_us;
+	uint8_t slot = g_fl_ring_tail;
+	uint8_t queued = g_fl_ring_queued;
+	
+	if (g_fl_command_timing != fltCOUNT && ftfl_busy())
+	{
+		elapsed_us = ftfl_elapsed_us(g_fl_command_start);
+		if (elapsed_us < g_fl_command_expected_us)
+		{
+			us += g_fl_command_expected_us - elapsed_us;
+		}
+	}
+	
+	switch (flash_state)
+	{
+		case flsBLANKCHECK:
+		case flsBLOCKBEGIN:
+			first = 0;
+			// Fall through
+		case flsPROGRAMSECTION:
+		case flsPROGRAMMING:
+			us += flash_count_longwords(g_fl_sector_data, first) * ftfl_longword_us();
+			// Fall through
+		case flsCLEARCACHE:
+		case flsVERIFY:
+		case flsMARGINCHECK:
+			// This one is counted already
+			if (queued)
+			{
+				queued--;
+				slot = (slot + 1) % DFU_SECTOR_RING_DEPTH;
+			}
+			break;
+			
+		default:
+			break;
+	}
+	
+	for (; queued; queued--)
+	{
+		us += g_fl_time_us[fltSECTOR] + flash_count_longwords(dfu_sector_ring[slot], 0) * ftfl_longword_us();
+		slot = (slot + 1) % DFU_SECTOR_RING_DEPTH;
+	}
+	
+	if (g_fl_preerase_address)
+	{
+		// The same steps flash_preerase_step() will take, past the one running
+		uint32_t address = g_fl_preerase_address + (flash_state == flsPREERASE ? FLASH_SECTOR_SIZE : 0);
+		
+		for (; address <= P_FLASH_END; address += FLASH_SECTOR_SIZE)
+		{
+			if (flash_get_sector_state(address) == fssUNKNOWN)
+			{
+				us += g_fl_time_us[fltERASE_SECTOR];
+			}
+		}
+	}
+	return us;
+}
+
+static uint16_t flash_poll_timeout()
+{
+	// Nearest whole millisecond, the host adds its own turnaround
+	uint32_t ms = (flash_remaining_us() + 500) / 1000;
+	
+	if (ms < 1)
+	{
+		return 1;
+	}
+	return (ms > 0xFFFF) ? 0xFFFF : ms;
+}
+
 bool dfu_getstatus(uint8_t *status)
 {
+    // Come back right away, unless the flash has work left or we're leaving
+    if (g_dfu_state != dfuMANIFEST) {
+        g_dfu_poll_timeout = 1;
+    }
+
     switch (g_dfu_state) {
 
         case dfuDNLOAD_SYNC:
         case dfuDNBUSY:
             // Programming operation in progress. 
 
-            if (g_dfu_state == dfuERROR) 
-			{
-              // An error occurred inside fl_state_poll();
-            } 
-			else if (flash_state == flsIDLE) 
-			{
-                g_dfu_state = dfuDNLOAD_IDLE;
-            } 
-			else 
-			{
-                g_dfu_state = dfuDNBUSY;
-            }
+            // The whole block is in the sector ring by now, a full ring holds
+            // up the data stage of the next one instead
+            g_dfu_state = dfuDNLOAD_IDLE;
             break;
 
         case dfuMANIFEST_SYNC:
+            // Wait for the last sectors to finish programming, and for a full
+            // replace to have erased everything past the end of the image.
+            // The host is told to come back when that should be done.
+            if (g_fl_ring_queued || flash_state != flsIDLE || g_fl_preerase_address)
+			{
+                g_dfu_poll_timeout = flash_poll_timeout();
+                break;
+            }
+			
             // Ready to reboot. The main thread will take care of this. Also let the DFU tool
             // know to leave us alone until this happens.
             g_dfu_state = dfuMANIFEST;
@@ -418,9 +1542,15 @@ bool dfu_clrstatus()
     switch (g_dfu_state) {
 
         case dfuERROR:
-            // Clear an error
+            // Clear an error. Blocks already staged stay, so the host can send
+            // the one that failed again and carry on, and a sector the flash
+            // gave up on is programmed again. A stream has ended though.
+#if DFU_STREAM
+            g_stream_open = false;
+#endif
             g_dfu_state = dfuIDLE;
             g_dfu_status = OK;
+            flash_kick();
             return true;
 
         default:
@@ -431,8 +1561,45 @@ bool dfu_clrstatus()
     }
 }
 
+bool dfu_set_alternate(uint8_t alternate)
+{
+	// Not in the middle of a transfer
+	if (g_dfu_state != dfuIDLE && g_dfu_state != dfuERROR)
+	{
+		return false;
+	}
+	
+	switch (alternate)
+	{
+		case DFU_ALT_DIFFERENTIAL:
+			// Whatever the pre-erase didn't get to stays as it is
+			g_fl_preerase_address = 0;
+			break;
+			
+		case DFU_ALT_FULL_REPLACE:
+			// The erase waits for the first block of a download
+			break;
+			
+		default:
+			return false;
+	}
+	
+	// Whatever comes next is a new download
+	flash_reset_staging();
+	g_fl_new_download = true;
+	g_dfu_alternate = alternate;
+	return true;
+}
+
+uint8_t dfu_get_alternate()
+{
+	return g_dfu_alternate;
+}
+
 bool dfu_set_idle()
 {
+    flash_reset_staging();
+    g_fl_new_download = true;
     g_dfu_state = dfuIDLE;
     g_dfu_status = OK;
     return true;
@@ -61,11 +61,85 @@ typedef enum {
 
 #define DFU_INTERFACE						0
 #define DFU_DETACH_TIMEOUT					10000   // 10 second timer
-#define DFU_TRANSFER_SIZE					64	// Ideally multiple of 64, and no more than flash sector size.
 #define FLASH_SECTOR_SIZE					0x800
+
+// wTransferSize. Any multiple of 64 that divides the flash sector size works,
+// a whole sector per DFU_DNLOAD keeps the host round trips to a minimum.
+#ifndef DFU_TRANSFER_SIZE
+#define DFU_TRANSFER_SIZE					FLASH_SECTOR_SIZE
+#endif
+
+#if (DFU_TRANSFER_SIZE > FLASH_SECTOR_SIZE) || (FLASH_SECTOR_SIZE % DFU_TRANSFER_SIZE) || (DFU_TRANSFER_SIZE % 64)
+#error "DFU_TRANSFER_SIZE must be a multiple of 64 that divides FLASH_SECTOR_SIZE"
+#endif
 #define APP_ORIGIN							0x2000
 #define P_FLASH_END							0x0003FFFF
 
+// The CPU's view of program flash. The host simulator (host/sim) provides its own.
+#ifndef FLASH_PTR
+#define FLASH_PTR(address)					((const void *)(address))
+#endif
+
+// DFU alternate settings. 0 only rewrites sectors that change, 1 erases the
+// whole application up front and is meant for downloads of a complete image.
+#define DFU_ALT_DIFFERENTIAL				0
+#define DFU_ALT_FULL_REPLACE				1
+#define DFU_NUM_ALTERNATES					2
+
+// FlexRAM doubles as the section program buffer for FTFL_CMD_PROGRAM_SECTOR.
+// Only half of it may be used per command, so a sector goes out in two sections.
+#define FLEXRAM_SIZE						0x800
+#define FLASH_SECTION_SIZE					(FLEXRAM_SIZE / 2)
+
+// Sectors that can be collected from USB while earlier ones are being programmed.
+// Two is enough to keep the flash busy, more only helps with very bursty hosts.
+#define DFU_SECTOR_RING_DEPTH				2
+
+// Compare each sector with flash first. Unchanged sectors are skipped, and
+// sectors that only fill in erased long words are programmed without an erase.
+#ifndef DFU_DIFFERENTIAL
+#define DFU_DIFFERENTIAL					1
+#endif
+
+// Past this many changed long words, erase + section programming is quicker
+#define DFU_DIFF_MAX_LONGWORDS				(FLASH_SECTOR_SIZE / 8)
+
+// All-ones long words are never programmed. A run of at least this many of
+// them splits a section program command in two rather than being written.
+#define DFU_BLANK_RUN_MIN					8
+
+// Application sectors tracked by the erased-sector map, and DFU blocks per sector
+#define FLASH_APP_SECTORS					((P_FLASH_END + 1 - APP_ORIGIN) / FLASH_SECTOR_SIZE)
+#define DFU_BLOCKS_PER_SECTOR				(FLASH_SECTOR_SIZE / DFU_TRANSFER_SIZE)
+#define DFU_ALL_BLOCKS						(0xFFFFFFFFUL >> (32 - DFU_BLOCKS_PER_SECTOR))
+
+// Read margin for the FTFL_CMD_READ_1S_SECTION blank check: 0 normal, 1 user, 2 factory.
+// User margin catches cells a plain read would still see as erased.
+#define FTFL_MARGIN_NORMAL					0x00
+#define FTFL_MARGIN_USER					0x01
+#define FTFL_MARGIN_FACTORY					0x02
+#define DFU_BLANK_CHECK_MARGIN				FTFL_MARGIN_USER
+
+// Verify after programming. FTFL_MARGIN_NORMAL compares the sector at a normal
+// read. FTFL_MARGIN_USER or FTFL_MARGIN_FACTORY then also has the FTFL read it
+// back at that margin, so weakly programmed or erased cells are caught. That
+// costs one Program Check per long word and one Read 1s Section per blank run.
+#ifndef DFU_VERIFY_LEVEL
+#define DFU_VERIFY_LEVEL					FTFL_MARGIN_NORMAL
+#endif
+
+// Vendor interface next to DFU. Its bulk OUT endpoint streams image data
+// straight into the sector ring, its bulk IN endpoint sends status reports:
+// bStatus, bState, flash idle, 0, then the bytes programmed so far (LE32).
+#ifndef DFU_STREAM
+#define DFU_STREAM							1
+#endif
+#define DFU_STREAM_REPORT_SIZE				8
+
+// Flash memory controller cache control bits in FMC_PFB0CR
+#define FMC_PFB0CR_CINV_WAY_ALL				0x00F00000	// Invalidate all cache ways
+#define FMC_PFB0CR_S_B_INV					0x00080000	// Invalidate prefetch speculation buffer
+
 // Flash commands
 #define FTFL_CMD_READ_1S_BLOCK          	0x00
 #define FTFL_CMD_READ_1S_SECTION        	0x01
@@ -95,6 +169,9 @@ typedef enum {
 // Main thread
 void dfu_init();
 
+// True once everything downloaded so far is in flash
+bool dfu_flash_idle();
+
 // USB entry points. Always successful.
 uint8_t dfu_getstate();
 
@@ -102,7 +179,27 @@ uint8_t dfu_getstate();
 bool dfu_getstatus(uint8_t *status);
 bool dfu_clrstatus();
 bool dfu_set_idle();
+bool dfu_set_alternate(uint8_t alternate);
+uint8_t dfu_get_alternate();
 bool dfu_download(unsigned blockNum, unsigned blockLength, unsigned packetOffset, unsigned packetLength, const uint8_t *data);
-bool dfu_upload(unsigned blockNum, uint16_t wLength, const uint8_t * data, uint32_t * returnedLength);
+bool dfu_upload(unsigned blockNum, uint16_t wLength, const uint8_t ** data, uint32_t * returnedLength);
+// Copies the next packet of a DFU_UPLOAD reply from flash into packet
+void dfu_upload_copy(uint8_t *packet, const uint8_t *data, uint32_t size);
+
+// True while a DFU_DNLOAD packet has to wait for a free sector slot
+bool dfu_download_busy(unsigned blockNum, unsigned packetOffset);
+
+void flash_state_machine();
+
+#if DFU_STREAM
+// Vendor stream entry points. True on success, false for stall.
+bool dfu_stream_begin(unsigned wBlockNum);
+bool dfu_stream_write(const uint8_t *data, unsigned length);
+bool dfu_stream_end();
+
+// True while the next packet has to wait for a free sector slot
+bool dfu_stream_busy();
 
-void flash_state_machine();
\ No newline at end of file
+// Fills in a status report, false if there is nothing to report
+bool dfu_stream_status(uint8_t *report);
+#endif
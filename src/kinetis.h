@@ -5678,6 +5678,7 @@ typedef struct __attribute__((packed)) {
 
 #define __disable_irq() __asm__ volatile("CPSID i":::"memory");
 #define __enable_irq()	__asm__ volatile("CPSIE i":::"memory");
+#define __WFI()		__asm__ volatile("wfi")
 
 // System Control Space (SCS), ARMv7 ref manual, B3.2, page 708
 #define SCB_CPUID		(*(const    uint32_t *)0xE000ED00) // CPUID Base Register
@@ -7,6 +7,7 @@
 
 #include "led_functions.h"
 #include "core_pins.h"
+#include "timebase.h"
 
 void led_init()
 {
@@ -40,13 +41,9 @@ void led_pulse_pattern_low(void)
 {
 	while (1) {
 		led_set();
-		for (long j = 100000; j; --j) {
-			__asm__ volatile ("nop");
-		}
+		timebase_delay_ms(5);
 		led_clear();
-		for (long j = 1000000; j; --j) {
-			__asm__ volatile ("nop");
-		}
+		timebase_delay_ms(50);
 	}
 };
 
@@ -54,13 +51,9 @@ void led_pulse_pattern_high(void)
 {
 	while (1) {
 		led_set();
-		for (long j = 10000000; j; --j) {
-			__asm__ volatile ("nop");
-		}
+		timebase_delay_ms(500);
 		led_clear();
-		for (long j = 1000000; j; --j) {
-			__asm__ volatile ("nop");
-		}
+		timebase_delay_ms(50);
 	}
 };
 
@@ -69,10 +62,7 @@ void led_pulse_pattern_regular_slow(void)
 {
 	while (1) {
 		led_toggle();
-		for (long j = 10000000; j; --j)
-		{
-			__asm__ volatile ("nop");
-		}
+		timebase_delay_ms(500);
 	}
 };
 
@@ -80,9 +70,6 @@ void led_pulse_pattern_regular_fast(void)
 {
 	while (1) {
 		led_toggle();
-		for (long j = 1000000; j; --j)
-		{
-			__asm__ volatile ("nop");
-		}
+		timebase_delay_ms(50);
 	}
 };
\ No newline at end of file
@@ -0,0 +1,213 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Freestanding memory primitives, see memory.h.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#include <stdint.h>
+#include "memory.h"
+
+// Keep GCC from recognizing the byte loops below as memcpy() or memset()
+// and turning them into calls to themselves.
+#define MEMORY_FUNCTION					__attribute__ ((optimize("no-tree-loop-distribute-patterns")))
+
+// The Cortex-M4 loads and stores single long words at any address, only
+// LDM/STM and the doubleword forms need them aligned.
+typedef struct { uint32_t value; } __attribute__ ((packed, may_alias)) unaligned_word_t;
+
+typedef uint32_t __attribute__ ((may_alias)) word_t;
+
+static inline int word_misalignment(const void *ptr)
+{
+	return (uintptr_t)ptr & 3;
+}
+
+MEMORY_FUNCTION
+void *memcpy(void *dst, const void *src, size_t cnt)
+{
+	uint8_t *dst8 = dst;
+	const uint8_t *src8 = src;
+
+	if (cnt >= 8)
+	{
+		while (word_misalignment(dst8))
+		{
+			*(dst8++) = *(src8++);
+			cnt--;
+		}
+
+		word_t *dst32 = (word_t *)dst8;
+
+		if (!word_misalignment(src8))
+		{
+			const word_t *src32 = (const word_t *)src8;
+			size_t blocks = cnt / 16;
+
+			if (blocks)
+			{
+#if defined(__arm__)
+				__asm__ volatile (
+					"1:	ldmia	%[src]!, {r3, r4, r5, r12}\n"
+					"	stmia	%[dst]!, {r3, r4, r5, r12}\n"
+					"	subs	%[blocks], %[blocks], #1\n"
+					"	bne		1b\n"
+					: [dst] "+r" (dst32), [src] "+r" (src32), [blocks] "+r" (blocks)
+					:
+					: "r3", "r4", "r5", "r12", "cc", "memory");
+#else
+				do
+				{
+					dst32[0] = src32[0];
+					dst32[1] = src32[1];
+					dst32[2] = src32[2];
+					dst32[3] = src32[3];
+					dst32 += 4;
+					src32 += 4;
+				} while (--blocks);
+#endif
+			}
+
+			for (cnt %= 16; cnt >= 4; cnt -= 4)
+			{
+				*(dst32++) = *(src32++);
+			}
+			src8 = (const uint8_t *)src32;
+		}
+		else
+		{
+			// Source and destination can't both be aligned, align the stores
+			for (; cnt >= 4; cnt -= 4)
+			{
+				*(dst32++) = ((const unaligned_word_t *)src8)->value;
+				src8 += 4;
+			}
+		}
+		dst8 = (uint8_t *)dst32;
+	}
+
+	while (cnt > 0)
+	{
+		cnt--;
+		*(dst8++) = *(src8++);
+	}
+	return dst;
+}
+
+MEMORY_FUNCTION
+void *memset(void *dst, int value, size_t cnt)
+{
+	uint8_t *dst8 = dst;
+
+	if (cnt >= 8)
+	{
+		while (word_misalignment(dst8))
+		{
+			*(dst8++) = (uint8_t)value;
+			cnt--;
+		}
+
+		word_t *dst32 = (word_t *)dst8;
+		uint32_t pattern = (uint8_t)value * 0x01010101UL;
+		size_t blocks = cnt / 16;
+
+		if (blocks)
+		{
+#if defined(__arm__)
+			__asm__ volatile (
+				"	mov		r3, %[pattern]\n"
+				"	mov		r4, %[pattern]\n"
+				"	mov		r5, %[pattern]\n"
+				"	mov		r12, %[pattern]\n"
+				"1:	stmia	%[dst]!, {r3, r4, r5, r12}\n"
+				"	subs	%[blocks], %[blocks], #1\n"
+				"	bne		1b\n"
+				: [dst] "+r" (dst32), [blocks] "+r" (blocks)
+				: [pattern] "r" (pattern)
+				: "r3", "r4", "r5", "r12", "cc", "memory");
+#else
+			do
+			{
+				dst32[0] = pattern;
+				dst32[1] = pattern;
+				dst32[2] = pattern;
+				dst32[3] = pattern;
+				dst32 += 4;
+			} while (--blocks);
+#endif
+		}
+
+		for (cnt %= 16; cnt >= 4; cnt -= 4)
+		{
+			*(dst32++) = pattern;
+		}
+		dst8 = (uint8_t *)dst32;
+	}
+
+	while (cnt > 0)
+	{
+		cnt--;
+		*(dst8++) = (uint8_t)value;
+	}
+	return dst;
+}
+
+MEMORY_FUNCTION
+int memcmp(const void *a, const void *b, size_t cnt)
+{
+	const uint8_t *a8 = a;
+	const uint8_t *b8 = b;
+
+	if (cnt >= 8 && word_misalignment(a8) == word_misalignment(b8))
+	{
+		while (word_misalignment(a8))
+		{
+			if (*a8 != *b8)
+			{
+				return *a8 - *b8;
+			}
+			a8++;
+			b8++;
+			cnt--;
+		}
+
+		// Skip the long words that match, the bytes below find out which way
+		// the first one that doesn't differs.
+		const word_t *a32 = (const word_t *)a8;
+		const word_t *b32 = (const word_t *)b8;
+
+		for (; cnt >= 16; cnt -= 16)
+		{
+			if ((a32[0] ^ b32[0]) | (a32[1] ^ b32[1]) | (a32[2] ^ b32[2]) | (a32[3] ^ b32[3]))
+			{
+				break;
+			}
+			a32 += 4;
+			b32 += 4;
+		}
+
+		for (; cnt >= 4; cnt -= 4)
+		{
+			if (*a32 != *b32)
+			{
+				break;
+			}
+			a32++;
+			b32++;
+		}
+		a8 = (const uint8_t *)a32;
+		b8 = (const uint8_t *)b32;
+	}
+
+	while (cnt > 0)
+	{
+		if (*a8 != *b8)
+		{
+			return *a8 - *b8;
+		}
+		a8++;
+		b8++;
+		cnt--;
+	}
+	return 0;
+}
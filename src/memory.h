@@ -0,0 +1,19 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Freestanding memory primitives.
+ *
+ * The bootloader links without a C library, these stand in for the ones the
+ * firmware uses. Word aligned runs go through LDM/STM four long words at a
+ * time, whatever doesn't line up is done a byte at a time at either end.
+ * Like all code they end up in .dtext, so they run from RAM and don't stall
+ * on flash while the FTFL is busy.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#pragma once
+#include <stddef.h>
+
+void *memcpy(void *dst, const void *src, size_t cnt);
+void *memset(void *dst, int value, size_t cnt);
+int memcmp(const void *a, const void *b, size_t cnt);
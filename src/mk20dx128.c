@@ -28,7 +28,10 @@
  * SOFTWARE.
  */
 
+#include <stdbool.h>
 #include "kinetis.h"
+#include "boot_profile.h"
+#include "boot_handoff.h"
 //#include "core_pins.h" // testing only
 //#include "ser_print.h" // testing only
 #include <errno.h>
@@ -72,6 +75,8 @@ extern unsigned long _estack;
 //extern void __init_array_end(void);
 
 extern int main (void);
+extern bool boot_fast_path(void);
+extern void boot_launch(void);
 void ResetHandler(void);
 void _init_Teensyduino_internal_(void) __attribute__((noinline));
 void __libc_init_array(void);
@@ -740,6 +745,28 @@ static void startup_default_late_hook(void) {}
 void startup_early_hook(void)		__attribute__ ((weak, alias("startup_default_early_hook")));
 void startup_late_hook(void)		__attribute__ ((weak, alias("startup_default_late_hook")));
 
+// Hand the CPU to the application. Called by the bootloader with the first two
+// entries of the application's vector table, never returns. In flash, for
+// boot_fast_path() to call before anything is copied to RAM.
+__attribute__ ((section(".launch")))
+void launch_application(uint32_t stack_pointer, uint32_t entry_point)
+{
+	__asm__ volatile (
+		// Fill the return address with 0xFFFFFFFF (we should never return to bootloader)
+		"mov lr, %0 \n\t"
+
+		// Set the stack pointer to Application IVT entry 0
+		"mov sp, %1 \n\t"
+
+		// Branch to program counter in Application IVT entry 1
+		"bx %2 \n\t"
+
+		// Corresponding data
+		: : "r" (0xFFFFFFFF),
+			"r" (stack_pointer),
+			"r" (entry_point) );
+}
+
 #if defined(__PURE_CODE__) || !defined(__OPTIMIZE__) || defined(__clang__)
 // cases known to compile too large for 0-0x400 memory region
 __attribute__ ((optimize("-Os")))
@@ -763,6 +790,25 @@ void ResetHandler(void)
 	__asm__ volatile ("nop");
 	__asm__ volatile ("nop");
 #endif
+
+	// Count cycles from here on. The cycle counter keeps running into the
+	// application, which can read ARM_DWT_CYCCNT to see how long it took to
+	// get there.
+	ARM_DEMCR |= ARM_DEMCR_TRCENA;
+	ARM_DWT_CYCCNT = 0;
+	ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
+	// Left over from the last boot, or whatever power up left in RAM
+	boot_profile.magic = BOOT_PROFILE_MAGIC;
+	boot_profile.version = BOOT_PROFILE_VERSION;
+	boot_profile.size = sizeof(boot_profile);
+	boot_profile.f_cpu = F_CPU;
+	for (i = 0; i < BOOT_PHASES; i++) boot_profile.cycles[i] = 0;
+	boot_handoff.magic = 0;
+
+	// Most resets go straight to the application, from here or once the
+	// clocks are up
+	bool launch = boot_fast_path();
 	// programs using the watchdog timer or needing to initialize hardware as
 	// early as possible can implement startup_early_hook()
 //	startup_early_hook();
@@ -889,6 +935,7 @@ void ResetHandler(void)
 	while ((MCG_S & MCG_S_IREFST) != 0) ;
 	// wait for MCGOUT to use oscillator
 	while ((MCG_S & MCG_S_CLKST_MASK) != MCG_S_CLKST(2));
+	BOOT_PROFILE_MARK(bpCRYSTAL);
 
 	// now in FBE mode
 	//  C1[CLKS] bits are written to 10
@@ -963,8 +1010,9 @@ void ResetHandler(void)
    #endif
 
 
-    // Copy things while we're waiting on the PLL
-    {
+    // Copy things while we're waiting on the PLL. Only when DFU mode, or
+    // main() with BOOT_FAST_PATH off, needs them.
+    if (!launch) {
         // Relocate data and text to RAM
         uint32_t *src = &_eflash;
         uint32_t *dest = &_sdtext;
@@ -984,6 +1032,7 @@ void ResetHandler(void)
 	while (!(MCG_S & MCG_S_PLLST)) ;
 	// wait for PLL to lock
 	while (!(MCG_S & MCG_S_LOCK0)) ;
+	BOOT_PROFILE_MARK(bpPLL_LOCK);
 	// now we're in PBE mode
   #endif
 #endif
@@ -1153,6 +1202,7 @@ void ResetHandler(void)
 	MCG_C1 = MCG_C1_CLKS(0) | MCG_C1_FRDIV(4);
 	// wait for PLL clock to be used
 	while ((MCG_S & MCG_S_CLKST_MASK) != MCG_S_CLKST(3)) ;
+	BOOT_PROFILE_MARK(bpCLOCKS);
 	// now we're in PEE mode
 	// USB uses PLL clock, trace is CPU clock, CLKOUT=OSCERCLK0
 	#if defined(KINETISK)
@@ -1186,6 +1236,9 @@ void ResetHandler(void)
 //	SYST_CSR = SYST_CSR_CLKSOURCE | SYST_CSR_TICKINT | SYST_CSR_ENABLE;
 //	SCB_SHPR3 = 0x20200000;  // Systick = priority 32
 
+	// The application gets the clocks as they are now
+	if (launch) boot_launch();
+
 	//init_pins();
 	__enable_irq();
 
@@ -0,0 +1,103 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Millisecond and microsecond time, see timebase.h.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#include <stdbool.h>
+#include "kinetis.h"
+#include "timebase.h"
+
+#define SYSTICK_RELOAD					(F_CPU / 1000 - 1)
+#define SOF_TIMEOUT_RELOAD				(F_CPU / 1000 * 3 / 2 - 1)	// Half a frame late
+#define CYCLES_PER_US					(F_CPU / 1000000)
+
+static volatile uint32_t g_tb_ms = 0;
+
+void timebase_init(void)
+{
+	SYST_RVR = SYSTICK_RELOAD;
+	SYST_CVR = 0;
+
+	// Same priority as USB, so the SysTick and SOF updates never interrupt
+	// each other
+	SCB_SHPR3 = (SCB_SHPR3 & 0x00FFFFFF) | ((uint32_t)NVIC_GET_PRIORITY(IRQ_USBOTG) << 24);
+	SYST_CSR = SYST_CSR_CLKSOURCE | SYST_CSR_TICKINT | SYST_CSR_ENABLE;
+}
+
+void timebase_stop(void)
+{
+	SYST_CSR = 0;
+	SYST_CVR = 0;
+	SCB_ICSR = SCB_ICSR_PENDSTCLR;
+}
+
+void systick_isr(void)
+{
+	// No SOF for a while, count milliseconds ourselves from the next one on
+	g_tb_ms++;
+	SYST_RVR = SYSTICK_RELOAD;
+}
+
+void timebase_sof(void)
+{
+	// Every SOF starts a millisecond. SysTick starts over with it and only
+	// gets to interrupt once SOFs stop coming. Coming back from SysTick this
+	// skips ahead by part of a millisecond, never back.
+	g_tb_ms++;
+	SYST_RVR = SOF_TIMEOUT_RELOAD;
+	SYST_CVR = 0;
+	SCB_ICSR = SCB_ICSR_PENDSTCLR;
+}
+
+uint32_t timebase_ms(void)
+{
+	return g_tb_ms;
+}
+
+uint32_t timebase_us(void)
+{
+	uint32_t ms;
+	uint32_t reload;
+	uint32_t cycles;
+	bool wrapped;
+
+	do
+	{
+		ms = g_tb_ms;
+		reload = SYST_RVR;
+		cycles = reload - SYST_CVR;
+		wrapped = (SCB_ICSR & SCB_ICSR_PENDSTSET) != 0;
+	} while (ms != g_tb_ms);
+
+	// Called with SysTick pending, from an interrupt at the same priority.
+	// A count close to the reload value was read before the wrap.
+	if (wrapped && cycles < reload / 2)
+	{
+		ms++;
+	}
+
+	// A late SOF doesn't get to run into the next millisecond
+	uint32_t us = cycles / CYCLES_PER_US;
+	return ms * 1000 + (us < 1000 ? us : 999);
+}
+
+void timebase_delay_ms(uint32_t ms)
+{
+	uint32_t start = timebase_us();
+
+	while (timebase_us() - start < ms * 1000)
+	{
+		__WFI();
+	}
+}
+
+void timebase_delay_us(uint32_t us)
+{
+	uint32_t start = timebase_us();
+
+	while (timebase_us() - start < us)
+	{
+	}
+}
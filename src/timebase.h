@@ -0,0 +1,33 @@
+/*
+ * MK20DX256 DFU Bootloader
+ * Millisecond and microsecond time.
+ *
+ * One monotonic clock for delays, timeouts and the LED, whatever F_CPU and
+ * the optimization level. SysTick counts milliseconds from reset. Once the
+ * host sends start of frame packets, every SOF counts a millisecond and
+ * restarts SysTick with a longer timeout, so while USB is up the CPU only
+ * wakes for SOF and SysTick fills in when SOFs stop, on suspend or a
+ * disconnect. Both stand still while the chip sleeps in VLPS.
+ *
+ * Same license as the rest of the bootloader, see src/dfu.c.
+ */
+
+#pragma once
+#include <stdint.h>
+
+void timebase_init(void);
+
+// Leaves SysTick the way reset does, for the application
+void timebase_stop(void);
+
+// From the USB start of frame interrupt
+void timebase_sof(void);
+
+uint32_t timebase_ms(void);
+uint32_t timebase_us(void);
+
+// Sleeps in WFI, interrupts keep running
+void timebase_delay_ms(uint32_t ms);
+
+// Spins, for waits well under a millisecond
+void timebase_delay_us(uint32_t us);
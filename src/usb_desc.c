@@ -72,7 +72,7 @@ static uint8_t device_descriptor[] = {
         LSB(DEVICE_VER), MSB(DEVICE_VER),       // bcdDevice
         1,                                      // iManufacturer
         2,                                      // iProduct
-        0,                                      // iSerialNumber
+        3,                                      // iSerialNumber
         1                                       // bNumConfigurations
 };
 
@@ -109,6 +109,17 @@ static uint8_t config_descriptor[CONFIG_DESC_SIZE] = {
         0x02,                                   // bInterfaceProtocol
         2,                                      // iInterface
 
+        // interface descriptor, DFU Mode, full replace alternate setting
+        9,                                      // bLength
+        4,                                      // bDescriptorType
+        DFU_INTERFACE,                          // bInterfaceNumber
+        DFU_ALT_FULL_REPLACE,                   // bAlternateSetting
+        0,                                      // bNumEndpoints
+        0xFE,                                   // bInterfaceClass
+        0x01,                                   // bInterfaceSubClass
+        0x02,                                   // bInterfaceProtocol
+        4,                                      // iInterface
+
         // DFU Functional Descriptor (DFU spec TAble 4.2)
         9,                                      // bLength
         0x21,                                   // bDescriptorType
@@ -118,6 +129,35 @@ static uint8_t config_descriptor[CONFIG_DESC_SIZE] = {
         LSB(DFU_TRANSFER_SIZE),                 // wTransferSize
         MSB(DFU_TRANSFER_SIZE),
         0x01,0x01,                              // bcdDFUVersion
+
+#if DFU_STREAM
+        // interface descriptor, vendor stream
+        9,                                      // bLength
+        4,                                      // bDescriptorType
+        STREAM_INTERFACE,                       // bInterfaceNumber
+        0,                                      // bAlternateSetting
+        2,                                      // bNumEndpoints
+        0xFF,                                   // bInterfaceClass
+        0x00,                                   // bInterfaceSubClass
+        0x00,                                   // bInterfaceProtocol
+        5,                                      // iInterface
+
+        // endpoint descriptor, image data
+        7,                                      // bLength
+        5,                                      // bDescriptorType
+        STREAM_RX_ENDPOINT,                     // bEndpointAddress
+        0x02,                                   // bmAttributes (0x02=bulk)
+        STREAM_SIZE, 0,                         // wMaxPacketSize
+        0,                                      // bInterval
+
+        // endpoint descriptor, status reports
+        7,                                      // bLength
+        5,                                      // bDescriptorType
+        STREAM_TX_ENDPOINT | 0x80,              // bEndpointAddress
+        0x02,                                   // bmAttributes (0x02=bulk)
+        STREAM_SIZE, 0,                         // wMaxPacketSize
+        0,                                      // bInterval
+#endif
 };
 
 
@@ -157,14 +197,22 @@ uint8_t usb_microsoft_wcid[MSFT_WCID_LEN] = {
     MSFT_WCID_LEN, 0, 0, 0,         // Length
     0x00, 0x01,                     // Version
     0x04, 0x00,                     // Compatibility ID descriptor index
-    0x01,                           // Number of sections
+    NUM_INTERFACE,                  // Number of sections
     0, 0, 0, 0, 0, 0, 0,            // Reserved (7 bytes)
 
-    0,                              // Interface number
+    DFU_INTERFACE,                  // Interface number
     0x01,                           // Reserved
     'W','I','N','U','S','B',0,0,    // Compatible ID
     0,0,0,0,0,0,0,0,                // Sub-compatible ID (unused)
     0,0,0,0,0,0,                    // Reserved
+
+#if DFU_STREAM
+    STREAM_INTERFACE,               // Interface number
+    0x01,                           // Reserved
+    'W','I','N','U','S','B',0,0,    // Compatible ID
+    0,0,0,0,0,0,0,0,                // Sub-compatible ID (unused)
+    0,0,0,0,0,0,                    // Reserved
+#endif
 };
 
 struct usb_string_descriptor_struct usb_string_manufacturer_name_default = {
@@ -177,6 +225,39 @@ struct usb_string_descriptor_struct usb_string_product_name_default = {
     3,
     PRODUCT_NAME
 };
+struct usb_string_descriptor_struct usb_string_full_replace = {
+    2 + FULL_REPLACE_NAME_LEN * 2,
+    3,
+    FULL_REPLACE_NAME
+};
+// Filled in from the chip's unique ID by usb_init_serialnumber()
+struct usb_string_descriptor_struct usb_string_serial_number = {
+    2 + SERIAL_NUMBER_LEN * 2,
+    3,
+    {[SERIAL_NUMBER_LEN - 1] = 0}
+};
+#if DFU_STREAM
+struct usb_string_descriptor_struct usb_string_stream = {
+    2 + STREAM_NAME_LEN * 2,
+    3,
+    STREAM_NAME
+};
+#endif
+
+// The 128 bit unique ID as hex, most significant digit first, so
+// hosts can tell a hub full of bootloaders apart
+void usb_init_serialnumber(void)
+{
+    const uint32_t uid[4] = {SIM_UIDH, SIM_UIDMH, SIM_UIDML, SIM_UIDL};
+    uint16_t *digit = usb_string_serial_number.wString;
+
+    for (int i = 0; i < 4; i++) {
+        for (int shift = 28; shift >= 0; shift -= 4) {
+            uint8_t nibble = (uid[i] >> shift) & 15;
+            *digit++ = nibble < 10 ? '0' + nibble : 'A' - 10 + nibble;
+        }
+    }
+}
 
 // **************************************************************
 //   Descriptors List
@@ -190,6 +271,11 @@ const usb_descriptor_list_t usb_descriptor_list[] = {
     {0x0300, (const uint8_t *)&string0, 0},
     {0x0301, (const uint8_t *)&usb_string_manufacturer_name, 0},
     {0x0302, (const uint8_t *)&usb_string_product_name, 0},
+    {0x0303, (const uint8_t *)&usb_string_serial_number, 0},
+    {0x0304, (const uint8_t *)&usb_string_full_replace, 0},
+#if DFU_STREAM
+    {0x0305, (const uint8_t *)&usb_string_stream, 0},
+#endif
     {0x03EE, (const uint8_t *)&usb_string_microsoft, 0},
     {0, NULL, 0}
 };
@@ -43,13 +43,43 @@
 #define MANUFACTURER_NAME_LEN     8
 #define PRODUCT_NAME              { 'B','o','o','t','l','o','a','d','e','r'}
 #define PRODUCT_NAME_LEN          10
+#define FULL_REPLACE_NAME         {'F','u','l','l',' ','r','e','p','l','a','c','e'}
+#define FULL_REPLACE_NAME_LEN     12
+#define SERIAL_NUMBER_LEN         32        // Hex digits of SIM_UIDH..SIM_UIDL
 #define EP0_SIZE                  64
+
+#if DFU_STREAM
+// Vendor stream interface, see DFU_STREAM in dfu.h
+#define STREAM_NAME               {'S','t','r','e','a','m'}
+#define STREAM_NAME_LEN           6
+#define STREAM_INTERFACE          1
+#define STREAM_RX_ENDPOINT        1
+#define STREAM_TX_ENDPOINT        2
+#define STREAM_SIZE               64
+#define STREAM_BEGIN              0x01    // Vendor request, wValue is the first DFU block number
+#define NUM_ENDPOINTS             2
+#define NUM_INTERFACE             2
+#define CONFIG_DESC_SIZE          (9+9*DFU_NUM_ALTERNATES+9+9+7+7)
+#else
+#define NUM_ENDPOINTS             0
 #define NUM_INTERFACE             1
-#define CONFIG_DESC_SIZE          (9+9+9)
+#define CONFIG_DESC_SIZE          (9+9*DFU_NUM_ALTERNATES+9)
+#endif
+
+// Cycles spent per control request and bus error counts, read back with a
+// vendor request to the device, see scripts/usb_stats.py
+#ifndef USB_STATS
+#define USB_STATS                 1
+#endif
+#define USB_STATS_REQUEST         0x02    // Vendor IN reads the counters, OUT clears them
+#define USB_STATS_SLOTS           16      // Distinct requests, the last slot takes the rest
+
+// Vendor IN request for this boot's boot_profile_t, see boot_profile.h
+#define BOOT_PROFILE_REQUEST      0x03
 
-// Microsoft Compatible ID Feature Descriptor
+// Microsoft Compatible ID Feature Descriptor, one function section per interface
 #define MSFT_VENDOR_CODE    '~'     // Arbitrary, but should be printable ASCII
-#define MSFT_WCID_LEN       40
+#define MSFT_WCID_LEN       (16+24*NUM_INTERFACE)
 extern uint8_t usb_microsoft_wcid[MSFT_WCID_LEN];
 
 typedef struct {
@@ -60,4 +90,6 @@ typedef struct {
 
 extern const usb_descriptor_list_t usb_descriptor_list[];
 
+void usb_init_serialnumber(void);
+
 #endif
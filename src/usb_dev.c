@@ -36,6 +36,9 @@
 #include "usb_dev.h"
 #include "usb_desc.h"
 #include "dfu.h"
+#include "memory.h"
+#include "timebase.h"
+#include "boot_profile.h"
 
 // buffer descriptor table
 typedef struct {
@@ -70,6 +73,7 @@ static bdt_t table[64];  // BDT page (512 bytes)
 #define DATA1 1
 #define index(endpoint, tx, odd) (((endpoint) << 2) | ((tx) << 1) | (odd))
 #define stat2bufferdescriptor(stat) (table + ((stat) >> 2))
+#define endpoint_control(endpoint) (*(&USB0_ENDPT0 + (endpoint) * 4))
 
 
 static union {
@@ -108,18 +112,105 @@ static union {
 // transactions in the data phase start with DATA1 and toggle (figure 8-12, USB1.1)
 // Status stage uses a DATA1 PID.
 
-static uint8_t ep0_rx0_buf[EP0_SIZE] __attribute__ ((aligned (4)));
-static uint8_t ep0_rx1_buf[EP0_SIZE] __attribute__ ((aligned (4)));
-
-static const uint8_t *ep0_tx_ptr = NULL;
+// OUT packets land in a pool of receive buffers, and DFU_DNLOAD data goes
+// from there straight into the sector ring. A packet the ring has no room for
+// yet keeps its buffer and the bank gets a fresh one, the host is only NAKed
+// once the pool runs dry.
+#if NUM_USB_BUFFERS < 2 || NUM_USB_BUFFERS > 32
+#error "NUM_USB_BUFFERS must be 2 to 32"
+#endif
+static uint8_t ep0_rx_pool[NUM_USB_BUFFERS][EP0_SIZE] __attribute__ ((aligned (4)));
+static uint32_t ep0_rx_free = 0;                    // One bit per pool buffer
+static uint8_t ep0_rx_held[NUM_USB_BUFFERS];        // Pool buffers waiting for the ring, oldest first
+static uint8_t ep0_rx_held_first = 0;
+static uint8_t ep0_rx_held_count = 0;
+static uint8_t ep0_rx_starved = 0;                  // Banks left without a buffer, one bit each
+static uint8_t ep0_rx_bdt_bank = 0;                 // Bank the next packet lands in
+
+// Replies longer than a packet go out from both banks, the next packet is
+// queued as soon as one completes so the host never has to wait for us.
+static const uint8_t *ep0_tx_ptr = NULL;    // Rest of the reply, NULL once all of it is queued
 static uint16_t ep0_tx_len;
+static bool ep0_tx_zlp;                     // Shorter than wLength, must end with a short packet
+static uint8_t ep0_tx_queued = 0;           // Banks the controller owns
 static uint16_t ep0_rx_offset;
 static uint8_t ep0_tx_bdt_bank = 0;
 static uint8_t ep0_tx_data_toggle = 0;
 
-static uint8_t reply_buffer[DFU_TRANSFER_SIZE] __attribute__ ((aligned (4)));
+// DFU_UPLOAD replies come straight from flash, which the USB DMA can't read
+// fast enough while the CPU runs from it. Each packet is copied into the
+// bank's buffer as it is queued, so the next one is ready in one bank while
+// the other is on the wire.
+static bool ep0_tx_from_flash;
+static uint8_t ep0_tx_buf[2][EP0_SIZE] __attribute__ ((aligned (4)));
+
+#if DFU_STREAM
+// Stream packets are received into both banks. One the sector ring can't take
+// yet keeps its buffer, and once both are held the controller NAKs the host.
+static uint8_t stream_rx_buf[2][STREAM_SIZE] __attribute__ ((aligned (4)));
+static uint8_t stream_rx_data_toggle = 0;
+static uint8_t stream_rx_held = 0;          // Packets waiting, oldest first
+static uint8_t stream_rx_held_bank = 0;
+
+// Status reports go out whenever they change, up to two queued at a time
+static uint8_t stream_tx_buf[2][DFU_STREAM_REPORT_SIZE] __attribute__ ((aligned (4)));
+static uint8_t stream_report[DFU_STREAM_REPORT_SIZE];  // Last one queued
+static uint8_t stream_tx_bdt_bank = 0;
+static uint8_t stream_tx_data_toggle = 0;
+#endif
 
 volatile uint8_t usb_configuration = 0;
+volatile uint8_t usb_suspended = 0;
+
+#if USB_STATS
+// Cycles from TOKDNE to handing the BDT back, per request. A copy goes out in
+// reply to USB_STATS_REQUEST, little endian like the host.
+typedef struct {
+    uint16_t wRequestAndType;               // 0xFFFF for the catch-all slot
+    uint16_t reserved;
+    uint32_t count;                         // Transactions, SETUP, DATA and STATUS
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+} usb_request_stats_t;
+
+typedef struct {
+    uint8_t version;
+    uint8_t slots;
+    uint8_t cpu_mhz;
+    uint8_t reserved;
+    uint32_t stalls;
+    uint32_t errors[8];                     // One per USB0_ERRSTAT bit
+    usb_request_stats_t request[USB_STATS_SLOTS];
+} usb_stats_t;
+
+// In .bss, usb_init() fills in the header
+static usb_stats_t usb_stats;
+
+static void usb_stats_record(uint32_t start)
+{
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+    usb_request_stats_t *r = usb_stats.request;
+    uint32_t n;
+
+    for (n = 0; n < USB_STATS_SLOTS - 1; n++, r++) {
+        if (!r->count) r->wRequestAndType = setup.wRequestAndType;
+        if (r->wRequestAndType == setup.wRequestAndType) break;
+    }
+    if (n == USB_STATS_SLOTS - 1) r->wRequestAndType = 0xFFFF;
+
+    if (!r->count || cycles < r->min_cycles) r->min_cycles = cycles;
+    if (cycles > r->max_cycles) r->max_cycles = cycles;
+    r->total_cycles += cycles;
+    r->count++;
+}
+
+#define REPLY_BUFFER_SIZE   (sizeof(usb_stats_t) > DFU_TRANSFER_SIZE ? sizeof(usb_stats_t) : DFU_TRANSFER_SIZE)
+#else
+#define REPLY_BUFFER_SIZE   DFU_TRANSFER_SIZE
+#endif
+
+static uint8_t reply_buffer[REPLY_BUFFER_SIZE] __attribute__ ((aligned (4)));
 
 
 static void endpoint0_stall(void)
@@ -133,15 +224,194 @@ static void endpoint0_transmit(const void *data, uint32_t len)
     table[index(0, TX, ep0_tx_bdt_bank)].desc = BDT_DESC(len, ep0_tx_data_toggle);
     ep0_tx_data_toggle ^= 1;
     ep0_tx_bdt_bank ^= 1;
+    ep0_tx_queued++;
+}
+
+static void endpoint0_transmit_next(void)
+{
+    uint32_t size;
+    const uint8_t *packet;
+
+    while (ep0_tx_ptr && ep0_tx_queued < 2) {
+        size = ep0_tx_len;
+        if (size > EP0_SIZE) size = EP0_SIZE;
+        packet = ep0_tx_ptr;
+        if (ep0_tx_from_flash) {
+            packet = ep0_tx_buf[ep0_tx_bdt_bank];
+            dfu_upload_copy(ep0_tx_buf[ep0_tx_bdt_bank], ep0_tx_ptr, size);
+        }
+        endpoint0_transmit(packet, size);
+        ep0_tx_ptr += size;
+        ep0_tx_len -= size;
+        // A short packet ends the data stage. A reply exactly as long as
+        // requested ends with its last full one, a shorter one that happens
+        // to be a multiple of EP0_SIZE needs a zero-length packet after it.
+        if (size < EP0_SIZE || (ep0_tx_len == 0 && !ep0_tx_zlp)) ep0_tx_ptr = NULL;
+    }
+}
+
+
+static void ep0_rx_arm(uint32_t bank)
+{
+    uint32_t n;
+
+    // Give a receive bank a free buffer, or remember it has none
+    if (!ep0_rx_free) {
+        ep0_rx_starved |= 1 << bank;
+        return;
+    }
+    n = __builtin_ctz(ep0_rx_free);
+    ep0_rx_free &= ~(1UL << n);
+    table[index(0, RX, bank)].addr = ep0_rx_pool[n];
+    table[index(0, RX, bank)].desc = BDT_DESC_RX(EP0_SIZE);
+}
+
+static void ep0_rx_release(const uint8_t *buf)
+{
+    uint32_t bank;
+
+    // Back to the pool, and on to a starved bank, the one the controller
+    // fills next first
+    ep0_rx_free |= 1UL << ((buf - ep0_rx_pool[0]) / EP0_SIZE);
+    if (ep0_rx_starved) {
+        bank = (ep0_rx_starved & (1 << ep0_rx_bdt_bank)) ? ep0_rx_bdt_bank : ep0_rx_bdt_bank ^ 1;
+        ep0_rx_starved &= ~(1 << bank);
+        ep0_rx_arm(bank);
+    }
+}
+
+static const uint8_t *ep0_rx_unhold(void)
+{
+    const uint8_t *buf = ep0_rx_pool[ep0_rx_held[ep0_rx_held_first]];
+
+    ep0_rx_held_first = (ep0_rx_held_first + 1) % NUM_USB_BUFFERS;
+    ep0_rx_held_count--;
+    return buf;
+}
+
+static void ep0_receive(void)
+{
+    const uint8_t *buf;
+    uint32_t size;
+
+    // Hand held DFU_DNLOAD packets to the sector ring, oldest first, for as
+    // long as it has room. The last one gets the status stage going.
+    while (ep0_rx_held_count && !dfu_download_busy(setup.wValue, ep0_rx_offset)) {
+        buf = ep0_rx_unhold();
+
+        if (setup.wIndex != 0 || ep0_rx_offset >= setup.wLength) {
+            endpoint0_stall();
+        } else {
+            size = setup.wLength - ep0_rx_offset;
+            if (size > EP0_SIZE) size = EP0_SIZE;
+
+            if (dfu_download(setup.wValue,   // blockNum
+                             setup.wLength,  // blockLength
+                             ep0_rx_offset,  // packetOffset
+                             size,           // packetLength
+                             buf)) {         // data
+
+                ep0_rx_offset += size;
+                if (ep0_rx_offset >= setup.wLength) {
+                    // End of transaction, acknowledge with a zero-length IN                
+                    endpoint0_transmit(reply_buffer, 0);
+                }
+            } else {
+                endpoint0_stall();
+            }
+        }
+        ep0_rx_release(buf);
+    }
 }
 
 
+#if DFU_STREAM
+static void stream_configure(void)
+{
+    if (!usb_configuration) {
+        endpoint_control(STREAM_RX_ENDPOINT) = 0;
+        endpoint_control(STREAM_TX_ENDPOINT) = 0;
+        return;
+    }
+
+    // Both receive banks take packets, the host starts over with DATA0
+    table[index(STREAM_RX_ENDPOINT, RX, EVEN)].addr = stream_rx_buf[EVEN];
+    table[index(STREAM_RX_ENDPOINT, RX, EVEN)].desc = BDT_DESC_RX(STREAM_SIZE);
+    table[index(STREAM_RX_ENDPOINT, RX, ODD)].addr = stream_rx_buf[ODD];
+    table[index(STREAM_RX_ENDPOINT, RX, ODD)].desc = BDT_DESC_RX(STREAM_SIZE);
+    stream_rx_data_toggle = DATA0;
+    stream_rx_held = 0;
+    stream_tx_data_toggle = DATA0;
+
+    endpoint_control(STREAM_RX_ENDPOINT) = USB_ENDPT_EPRXEN | USB_ENDPT_EPHSHK;
+    endpoint_control(STREAM_TX_ENDPOINT) = USB_ENDPT_EPTXEN | USB_ENDPT_EPHSHK;
+}
+
+static void stream_receive(void)
+{
+    // Hand held packets to the sector ring, oldest first, for as long as it
+    // has room. A short packet ends the image.
+    while (stream_rx_held && !dfu_stream_busy()) {
+        bdt_t *b = table + index(STREAM_RX_ENDPOINT, RX, stream_rx_held_bank);
+        uint32_t count = (b->desc >> 16) & 0x3FF;
+
+        if ((count && !dfu_stream_write(b->addr, count)) || (count < STREAM_SIZE && !dfu_stream_end())) {
+            endpoint_control(STREAM_RX_ENDPOINT) |= USB_ENDPT_EPSTALL;
+        }
+
+        b->desc = BDT_DESC_RX(STREAM_SIZE);
+        stream_rx_held_bank ^= 1;
+        stream_rx_held--;
+    }
+}
+
+static void stream_send_report(void)
+{
+    bdt_t *b = table + index(STREAM_TX_ENDPOINT, TX, stream_tx_bdt_bank);
+    uint8_t report[DFU_STREAM_REPORT_SIZE];
+
+    if ((b->desc & BDT_OWN) || !dfu_stream_status(report)) return;
+    if (!memcmp(report, stream_report, sizeof(report))) return;
+
+    memcpy(stream_report, report, sizeof(report));
+    memcpy(stream_tx_buf[stream_tx_bdt_bank], report, sizeof(report));
+    b->addr = stream_tx_buf[stream_tx_bdt_bank];
+    b->desc = BDT_DESC(sizeof(report), stream_tx_data_toggle);
+    stream_tx_data_toggle ^= 1;
+    stream_tx_bdt_bank ^= 1;
+}
+
+static void usb_stream(uint32_t stat)
+{
+    bdt_t *b = stat2bufferdescriptor(stat);
+
+    if ((stat >> 4) == STREAM_RX_ENDPOINT && !(stat & 0x08)) {
+        // A toggle we've seen already is the host resending a packet it
+        // didn't get our ACK for
+        if (((b->desc & BDT_DATA1) ? DATA1 : DATA0) != stream_rx_data_toggle) {
+            b->desc = BDT_DESC_RX(STREAM_SIZE);
+            return;
+        }
+        stream_rx_data_toggle ^= 1;
+
+        if (stream_rx_held++ == 0) {
+            stream_rx_held_bank = (stat >> 2) & 1;
+        }
+        stream_receive();
+    }
+
+    // A report went out, or a packet came in that changed things
+    stream_send_report();
+}
+#endif
+
+
 static void usb_setup(void)
 {
     const uint8_t *data = NULL;
     uint32_t datalen = 0;
+    bool from_flash = false;
     const usb_descriptor_list_t *list;
-    uint32_t size;
     int i;
 
     switch (setup.wRequestAndType) {
@@ -149,12 +419,30 @@ static void usb_setup(void)
         break;
       case 0x0900: // SET_CONFIGURATION
         usb_configuration = setup.wValue;
+#if DFU_STREAM
+        stream_configure();
+#endif
         break;
       case 0x0880: // GET_CONFIGURATION
         reply_buffer[0] = usb_configuration;
         datalen = 1;
         data = reply_buffer;
         break;
+      case 0x0b01: // SET_INTERFACE
+        if (setup.wIndex != DFU_INTERFACE || setup.wValue > 0xFF || !dfu_set_alternate(setup.wValue)) {
+            endpoint0_stall();
+            return;
+        }
+        break;
+      case 0x0a81: // GET_INTERFACE
+        if (setup.wIndex != DFU_INTERFACE) {
+            endpoint0_stall();
+            return;
+        }
+        reply_buffer[0] = dfu_get_alternate();
+        datalen = 1;
+        data = reply_buffer;
+        break;
       case 0x0080: // GET_STATUS (device)
         reply_buffer[0] = 0;
         reply_buffer[1] = 0;
@@ -162,34 +450,39 @@ static void usb_setup(void)
         data = reply_buffer;
         break;
       case 0x0082: // GET_STATUS (endpoint)
-        if (setup.wIndex > 0) {
+        i = setup.wIndex & 0x7F;
+        if (i > NUM_ENDPOINTS) {
             endpoint0_stall();
             return;
         }
         reply_buffer[0] = 0;
         reply_buffer[1] = 0;
-        if (*(uint8_t *)(&USB0_ENDPT0 + setup.wIndex * 4) & 0x02) reply_buffer[0] = 1;
+        if (endpoint_control(i) & 0x02) reply_buffer[0] = 1;
         data = reply_buffer;
         datalen = 2;
         break;
       case 0x0102: // CLEAR_FEATURE (endpoint)
         i = setup.wIndex & 0x7F;
-        if (i > 0 || setup.wValue != 0) {
+        if (i > NUM_ENDPOINTS || setup.wValue != 0) {
             // TODO: do we need to handle IN vs OUT here?
             endpoint0_stall();
             return;
         }
-        (*(uint8_t *)(&USB0_ENDPT0 + setup.wIndex * 4)) &= ~0x02;
-        // TODO: do we need to clear the data toggle here?
+        endpoint_control(i) &= ~0x02;
+#if DFU_STREAM
+        // Clearing a halt starts the endpoint over at DATA0
+        if (i == STREAM_RX_ENDPOINT) stream_rx_data_toggle = DATA0;
+        if (i == STREAM_TX_ENDPOINT) stream_tx_data_toggle = DATA0;
+#endif
         break;
       case 0x0302: // SET_FEATURE (endpoint)
         i = setup.wIndex & 0x7F;
-        if (i > 0 || setup.wValue != 0) {
+        if (i > NUM_ENDPOINTS || setup.wValue != 0) {
             // TODO: do we need to handle IN vs OUT here?
             endpoint0_stall();
             return;
         }
-        (*(uint8_t *)(&USB0_ENDPT0 + setup.wIndex * 4)) |= 0x02;
+        endpoint_control(i) |= 0x02;
         // TODO: do we need to clear the data toggle here?
         break;
       case 0x0680: // GET_DESCRIPTOR
@@ -223,38 +516,66 @@ static void usb_setup(void)
         endpoint0_stall();
         return;
 
+      case (BOOT_PROFILE_REQUEST << 8) | 0xC0: // Where the time went on the way here
+        data = (const uint8_t *)&boot_profile;
+        datalen = sizeof(boot_profile);
+        break;
+
+#if USB_STATS
+      case (USB_STATS_REQUEST << 8) | 0xC0:    // Request timing and bus errors
+        // The live table keeps counting while the reply goes out, and this
+        // request itself lands in it once the SETUP is handled
+        memcpy(reply_buffer, &usb_stats, sizeof(usb_stats));
+        data = reply_buffer;
+        datalen = sizeof(usb_stats);
+        break;
+      case (USB_STATS_REQUEST << 8) | 0x40:    // Start counting over
+        usb_stats.stalls = 0;
+        memset(usb_stats.errors, 0, sizeof(usb_stats.errors));
+        memset(usb_stats.request, 0, sizeof(usb_stats.request));
+        break;
+#endif
+
       case 0x0121: // DFU_DNLOAD
         if (setup.wIndex > 0) {
             endpoint0_stall();
             return;
         }
+        // We can't take more than one block per request
+        if (setup.wLength > DFU_TRANSFER_SIZE) {
+            endpoint0_stall();
+            return;
+        }
         // Data comes in the OUT phase. But if it's a zero-length request, handle it now.
         if (setup.wLength == 0) {
             if (!dfu_download(setup.wValue, 0, 0, 0, NULL)) {
                 endpoint0_stall();
             }
+            break;
         }
-        break;
+        // The status stage goes out with the last OUT packet, queuing it now
+        // would leave a stale zero-length packet behind.
+        return;
 		
 		case 0x02a1: // DFU_UPLOAD
-		if (setup.wIndex > 0) {
+		if (setup.wIndex > 0 || setup.wLength > DFU_TRANSFER_SIZE) {
 			endpoint0_stall();
 			return;
 		}
- 		if (dfu_upload(setup.wValue, setup.wLength, &reply_buffer, &datalen) == true) 
-		{
-			// Success, send data!
-			data = reply_buffer;
-			break;
-		}
-		else
-		{
-			// Fail, or end of stream		
-			data = reply_buffer;
-			break;
-		}	
+		// A block of flash, or nothing at the end of it
+		dfu_upload(setup.wValue, setup.wLength, &data, &datalen);
+		from_flash = true;
 		break;
 
+#if DFU_STREAM
+      case (STREAM_BEGIN << 8) | 0x41: // Vendor stream, start of an image
+        if (setup.wIndex != STREAM_INTERFACE || !dfu_stream_begin(setup.wValue)) {
+            endpoint0_stall();
+            return;
+        }
+        break;
+#endif
+
       case 0x03a1: // DFU_GETSTATUS
         if (setup.wIndex > 0) {
             endpoint0_stall();
@@ -311,46 +632,22 @@ static void usb_setup(void)
 
 	// Sanity check but not gracefully handled
     if (datalen > setup.wLength) datalen = setup.wLength;
-		
-// 	do
-// 	{
-// 		size = datalen;
-// 		if (size > EP0_SIZE) size = EP0_SIZE;
-// 		endpoint0_transmit(data, size);
-// 		data += size;
-// 		datalen -= size;
-// 		watchdog_refresh();
-// 	} while (!(datalen == 0 && size < EP0_SIZE));
-// 
-// 	return;
-
-    size = datalen;
-    if (size > EP0_SIZE) size = EP0_SIZE;
-    endpoint0_transmit(data, size);
-    data += size;
-    datalen -= size;
-    if (datalen == 0 && size < EP0_SIZE) return;
-
-// 	Why two, this should never execute?
-
-//     size = datalen;
-//     if (size > EP0_SIZE) size = EP0_SIZE;
-//     endpoint0_transmit(data, size);
-//     data += size;
-//     datalen -= size;
-//     if (datalen == 0 && size < EP0_SIZE) return;
-// 
-//     ep0_tx_ptr = data;
-//     ep0_tx_len = datalen;
+
+    // The first two packets go out now, the rest (DFU_UPLOAD blocks) as the
+    // IN transactions complete. No data at all is the zero-length status stage.
+    ep0_tx_ptr = data ? data : reply_buffer;
+    ep0_tx_len = datalen;
+    ep0_tx_zlp = datalen < setup.wLength;
+    ep0_tx_from_flash = from_flash;
+    endpoint0_transmit_next();
 }
 
 
 static void usb_control(uint32_t stat)
 {
     bdt_t *b;
-    uint32_t pid, size;
+    uint32_t pid;
     uint8_t *buf;
-    const uint8_t *data;
 
     b = stat2bufferdescriptor(stat);
     pid = BDT_PID(b->desc);
@@ -364,9 +661,19 @@ static void usb_control(uint32_t stat)
 
         // Give the buffer back
         b->desc = BDT_DESC_RX(EP0_SIZE);
+        ep0_rx_bdt_bank = ((stat >> 2) & 1) ^ 1;
 
-        // clear any leftover pending IN transactions
+        // Drop DFU_DNLOAD packets of a transfer the host gave up on
+        while (ep0_rx_held_count) ep0_rx_release(ep0_rx_unhold());
+
+        // clear any leftover pending IN transactions. The controller holds
+        // off while TXSUSPENDTOKENBUSY is set, so the banks are ours again,
+        // and it only moved past the ones the host took.
         ep0_tx_ptr = NULL;
+        if (ep0_tx_queued & 1) ep0_tx_bdt_bank ^= 1;
+        ep0_tx_queued = 0;
+        table[index(0, TX, EVEN)].desc = 0;
+        table[index(0, TX, ODD)].desc = 0;
 
         // first IN or OUT after Setup is always DATA1
         ep0_tx_data_toggle = 1;
@@ -383,30 +690,16 @@ static void usb_control(uint32_t stat)
 
     case 0x01:  // OUT transaction received from host
 
-        // The only control OUT request we have now, DFU_DNLOAD
-        if (setup.wRequestAndType == 0x0121) {
+        ep0_rx_bdt_bank = ((stat >> 2) & 1) ^ 1;
 
-            if (setup.wIndex != 0 && ep0_rx_offset > setup.wLength) {
-                endpoint0_stall();
-            } else {
-                size = setup.wLength - ep0_rx_offset;
-                if (size > EP0_SIZE) size = EP0_SIZE;
-
-                if (dfu_download(setup.wValue,   // blockNum
-                                 setup.wLength,  // blockLength
-                                 ep0_rx_offset,  // packetOffset
-                                 size,           // packetLength
-                                 buf)) {         // data
-
-                    ep0_rx_offset += size;
-                    if (ep0_rx_offset >= setup.wLength) {
-                        // End of transaction, acknowledge with a zero-length IN                
-                       endpoint0_transmit(reply_buffer, 0);
-                    }
-                } else {
-                    endpoint0_stall();
-                }
-            }
+        // The only control OUT request we have now, DFU_DNLOAD. The packet
+        // keeps its buffer until it is in the sector ring.
+        if (setup.wRequestAndType == 0x0121) {
+            ep0_rx_held[(ep0_rx_held_first + ep0_rx_held_count) % NUM_USB_BUFFERS] = (buf - ep0_rx_pool[0]) / EP0_SIZE;
+            ep0_rx_held_count++;
+            ep0_rx_arm((stat >> 2) & 1);
+            ep0_receive();
+            break;
         }
 
         // Give the buffer back
@@ -415,15 +708,8 @@ static void usb_control(uint32_t stat)
 
     case 0x09: // IN transaction completed to host
         // send remaining data, if any...
-        data = ep0_tx_ptr;
-        if (data) {
-            size = ep0_tx_len;
-            if (size > EP0_SIZE) size = EP0_SIZE;
-            endpoint0_transmit(data, size);
-            data += size;
-            ep0_tx_len -= size;
-            ep0_tx_ptr = (ep0_tx_len > 0 || size == EP0_SIZE) ? data : NULL;
-        }
+        if (ep0_tx_queued) ep0_tx_queued--;
+        endpoint0_transmit_next();
 
         if (setup.bRequest == 5 && setup.bmRequestType == 0) {
             setup.bRequest = 0;
@@ -434,6 +720,23 @@ static void usb_control(uint32_t stat)
     USB0_CTL = USB_CTL_USBENSOFEN; // clear TXSUSPENDTOKENBUSY bit
 }
 
+static void usb_resume(void)
+{
+    // Out of VLPS the MCG is in PBE, running from the crystal. Back onto
+    // the PLL first, USB runs from it.
+    if ((MCG_S & MCG_S_CLKST_MASK) != MCG_S_CLKST(3)) {
+        while (!(MCG_S & MCG_S_LOCK0)) ;
+        MCG_C1 &= ~MCG_C1_CLKS(3);
+        while ((MCG_S & MCG_S_CLKST_MASK) != MCG_S_CLKST(3)) ;
+    }
+
+    SCB_SCR &= ~SCB_SCR_SLEEPDEEP;
+    USB0_USBTRC0 &= ~USB_USBTRC_USBRESMEN;
+    USB0_USBCTRL &= ~USB_USBCTRL_SUSP;
+    USB0_INTEN &= ~USB_INTEN_RESUMEEN;
+    USB0_ISTAT = USB_ISTAT_RESUME;
+    usb_suspended = 0;
+}
 
 void usb_isr(void)
 {	
@@ -441,6 +744,23 @@ void usb_isr(void)
 	
      uint8_t status, stat;
  
+    // Resume signaling, or a reset, ends suspend. The resume detector is
+    // what woke us if the main thread was in VLPS.
+    if (usb_suspended && ((USB0_USBTRC0 & USB_USBTRC_USB_RESUME_INT) ||
+        (USB0_ISTAT & (USB_ISTAT_RESUME | USB_ISTAT_USBRST)))) {
+        usb_resume();
+    }
+
+    // Held packets the sector ring has room for now, and news for the
+    // host. The flash state machine pends this interrupt for both.
+    ep0_receive();
+#if DFU_STREAM
+    if (usb_configuration) {
+        stream_receive();
+        stream_send_report();
+    }
+#endif
+
  	restart:
  	
  	status = USB0_ISTAT;
@@ -448,6 +768,7 @@ void usb_isr(void)
     if ((status & USB_ISTAT_SOFTOK /* 04 */ )) {
         // Clear SOF interrupt
 		USB0_ISTAT = USB_ISTAT_SOFTOK;
+        timebase_sof();
     }
  
 	if ((status & USB_ISTAT_TOKDNE /* 08 */ )) {
@@ -455,8 +776,19 @@ void usb_isr(void)
         stat = USB0_STAT;
         endpoint = stat >> 4;
         if (endpoint == 0) {
+#if USB_STATS
+            uint32_t start = ARM_DWT_CYCCNT;
             usb_control(stat);
+            usb_stats_record(start);
+#else
+            usb_control(stat);
+#endif
+        }
+#if DFU_STREAM
+        else {
+            usb_stream(stat);
         }
+#endif
         USB0_ISTAT = USB_ISTAT_TOKDNE;
         goto restart;
     }
@@ -466,12 +798,22 @@ void usb_isr(void)
         // initialize BDT toggle bits
         USB0_CTL = USB_CTL_ODDRST;
         ep0_tx_bdt_bank = 0;
+        ep0_tx_queued = 0;
+        usb_configuration = 0;
+#if DFU_STREAM
+        stream_tx_bdt_bank = 0;
+        table[index(STREAM_TX_ENDPOINT, TX, EVEN)].desc = 0;
+        table[index(STREAM_TX_ENDPOINT, TX, ODD)].desc = 0;
+        stream_configure();
+#endif
 
         // set up buffers to receive Setup and OUT packets
-        table[index(0, RX, EVEN)].desc = BDT_DESC_RX(EP0_SIZE);
-        table[index(0, RX, EVEN)].addr = ep0_rx0_buf;
-        table[index(0, RX, ODD)].desc = BDT_DESC_RX(EP0_SIZE);
-        table[index(0, RX, ODD)].addr = ep0_rx1_buf;
+        ep0_rx_free = (NUM_USB_BUFFERS == 32) ? 0xFFFFFFFF : (1UL << NUM_USB_BUFFERS) - 1;
+        ep0_rx_held_count = 0;
+        ep0_rx_starved = 0;
+        ep0_rx_bdt_bank = EVEN;
+        ep0_rx_arm(EVEN);
+        ep0_rx_arm(ODD);
         table[index(0, TX, EVEN)].desc = 0;
         table[index(0, TX, ODD)].desc = 0;
         
@@ -502,20 +844,41 @@ void usb_isr(void)
     if ((status & USB_ISTAT_STALL /* 80 */ )) {
         USB0_ENDPT0 = USB_ENDPT_EPRXEN | USB_ENDPT_EPTXEN | USB_ENDPT_EPHSHK;
         USB0_ISTAT = USB_ISTAT_STALL;
+#if USB_STATS
+        usb_stats.stalls++;
+#endif
     }
 
     if ((status & USB_ISTAT_ERROR /* 02 */ )) {
         uint8_t err = USB0_ERRSTAT;
         USB0_ERRSTAT = err;
         USB0_ISTAT = USB_ISTAT_ERROR;
+#if USB_STATS
+        for (int bit = 0; bit < 8; bit++) {
+            if (err & (1 << bit)) usb_stats.errors[bit]++;
+        }
+#endif
     }
 
     if ((status & USB_ISTAT_SLEEP /* 10 */ )) {
-        USB0_ISTAT = USB_ISTAT_SLEEP;
+        // No traffic for 3 ms, the host suspended the bus. Put the
+        // transceiver to sleep and leave resume detection on, both the
+        // interrupt and the asynchronous one that works in VLPS.
+        USB0_ISTAT = USB_ISTAT_SLEEP | USB_ISTAT_RESUME;
+        USB0_INTEN |= USB_INTEN_RESUMEEN;
+        USB0_USBCTRL |= USB_USBCTRL_SUSP;
+        USB0_USBTRC0 |= USB_USBTRC_USBRESMEN;
+        usb_suspended = 1;
     }
 }
 
 
+bool usb_ep0_idle(void)
+{
+    // Everything queued on EP0 has gone out to the host
+    return !ep0_tx_ptr && !ep0_tx_queued;
+}
+
 void usb_init(void)
 {
     // this basically follows the flowchart in the Kinetis
@@ -525,6 +888,14 @@ void usb_init(void)
     // SIM - enable clock
     SIM_SCGC4 |= SIM_SCGC4_USBOTG;
 
+    usb_init_serialnumber();
+
+#if USB_STATS
+    usb_stats.version = 1;
+    usb_stats.slots = USB_STATS_SLOTS;
+    usb_stats.cpu_mhz = F_CPU / 1000000;
+#endif
+
 /*
     // reset USB module
     USB0_USBTRC0 = USB_USBTRC_USBRESET;
@@ -39,8 +39,10 @@ extern "C" {
 
 void usb_init(void);
 void usb_isr(void);
+bool usb_ep0_idle(void);
 
 extern volatile uint8_t usb_configuration;
+extern volatile uint8_t usb_suspended;
 
 #ifdef __cplusplus
 }